@@ -1,14 +1,22 @@
 import graphlab as gl
+import libffm
 
-def read_libffm_file(filename):
+def read_libffm_file(filename, nr_threads=1):
     """
     Create an SFrame from a text file in libffm format.
 
+    The file is parsed in C++ on nr_threads threads. For files that are
+    only used for training, the ffm-convert tool writes a binary shard
+    instead, which ffm-train reads without building an SFrame at all.
+
     Parameters
     ----------
     f : str
       Name of the filename.
 
+    nr_threads : int
+      The number of threads to parse with.
+
     Returns
     -------
     out : SFrame
@@ -24,23 +32,4 @@ def read_libffm_file(filename):
 
     """
 
-    def make_dict(z):
-        d = {}
-        for (f, k, v) in z:
-            if f not in d:
-                d[f] = {}
-            d[f][int(k)] = float(v)
-        return d
-
-
-    x = gl.SFrame.read_csv(filename, header=False)
-    x['s'] = x['X1'].apply(lambda x: x.split(' '))
-    x['y'] = x['s'].apply(lambda x: int(x[0]))
-    x['y'] = x['y'].astype(int)
-    x['features'] = x['s'].apply(lambda x: x[1:])
-    x['features'] = x['features'].apply(lambda x: [z.split(':') for z in x])
-    x['features'] = x['features'].apply(lambda x: make_dict(x))
-    sf = x[['y', 'features']]
-    return sf.unpack('features')
-
-
+    return libffm.ffm_py().read_text(filename, nr_threads)
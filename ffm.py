@@ -1,3 +1,7 @@
+import os
+import shutil
+import tempfile
+
 import graphlab as gl
 import libffm
 
@@ -33,7 +37,10 @@ class FFM(object):
             target='target', features=None,
             max_feature_id=2**18,
             nr_iters=15, nr_threads=1,
-            quiet=False):
+            quiet=False, random=True, sparse=False, auto_stop=False,
+            patience=1, batch_size=1, cache_path=None,
+            checkpoint_path=None, checkpoint_interval=1, resume_path=None,
+            warm_start=False):
         """
         Train the model.
 
@@ -68,7 +75,56 @@ class FFM(object):
           If true, the algorithm will perform instance-wise normalization.
 
         random : boolean
-          If true, the rows will be shuffled prior to training.
+          If true, the rows are visited in a new random order each iteration.
+          The shuffle keeps nearby rows together, so it costs little even for
+          large datasets.
+
+        sparse : boolean
+          If true, weights are only allocated for feature ids that occur in
+          the training data instead of for all of max_feature_id. Use this
+          with hashed feature ids, where most of the id space goes unused.
+
+        auto_stop : boolean
+          If true, training stops once the loss on validation_set has not
+          improved for `patience` iterations, and the model from the best
+          iteration is kept. Requires a validation_set.
+
+        patience : int
+          The number of iterations without improvement that auto_stop
+          tolerates.
+
+        batch_size : int
+          The number of rows whose gradients each thread sums before
+          updating the model. Values above 1 reduce contention between
+          threads on features shared by many rows.
+
+        cache_path : str, optional
+          The SFrames are decoded once into a compact node cache before
+          training. By default the cache is held in memory; if a path is
+          given it is written to disk there and memory-mapped instead, for
+          datasets that do not fit in RAM.
+
+        checkpoint_path : str, optional
+          If given, the weights and optimizer state are saved there every
+          `checkpoint_interval` iterations. The file is written in the
+          background while training continues.
+
+        checkpoint_interval : int
+          The number of iterations between checkpoints.
+
+        resume_path : str, optional
+          A checkpoint to continue training from. The data and the other
+          parameters must be the same as those of the run that wrote it;
+          training picks up after the last iteration it saved and runs up
+          to nr_iters.
+
+        warm_start : boolean
+          If true, training continues from the current model, i.e. the one
+          from the previous call to fit or load_model, for nr_iters
+          more iterations on the new data instead of starting over. New
+          feature ids are added. Only the weights carry over; if
+          resume_path is also given, the model and AdaGrad state stored in
+          that checkpoint are used instead.
 
         Returns
         -------
@@ -76,11 +132,9 @@ class FFM(object):
 
         Note
         ----
-        The original library has two additional options that have not (yet)
+        The original library has an additional option that has not (yet)
         been exposed in this library:
 
-        - random: rows can are processed in random order. When using this
-                  wrapper, it's best to shuffle ahead of time.
         - normalization: sometimes this algorithm benefits from normalizing the
                          values row-wise. This wrapper currently requires you
                          to do that ahead of time.
@@ -89,6 +143,8 @@ class FFM(object):
 
         if target not in train.column_names():
             raise ValueError, "Target column `{0}` not found in dataset.".format(target)
+        if auto_stop and validation_set is None:
+            raise ValueError, "auto_stop requires a validation_set."
         if validation_set is not None:
             if train.column_names() != validation_set.column_names():
                 raise ValueError, "Train, validation data must have the same column names."
@@ -96,8 +152,119 @@ class FFM(object):
             validation_set = train.head(0)
         if features is None:
             features = [c for c in train.column_names() if c is not target]
-        self.m.set_param(nr_iters, nr_threads, quiet)
-        self.m.fit(train, validation_set, target, features, max_feature_id)
+        self.m.set_param(nr_iters, nr_threads, quiet, random, sparse,
+                         auto_stop, patience, batch_size)
+        if cache_path is None:
+            cache_path = ''
+        if checkpoint_path is None:
+            checkpoint_path = ''
+        if resume_path is None:
+            resume_path = ''
+        self.m.fit(train, validation_set, target, features, max_feature_id,
+                   cache_path, checkpoint_path, checkpoint_interval,
+                   resume_path, warm_start)
+
+    def fit_arrays(self, field, index, value, indptr, label,
+                   validation_set=None,
+                   nr_iters=15, nr_threads=1,
+                   quiet=False, random=True, sparse=False, auto_stop=False,
+                   patience=1, batch_size=1,
+                   checkpoint_path=None, checkpoint_interval=1,
+                   resume_path=None, warm_start=False):
+        """
+        Train the model on data in CSR form, e.g. from NumPy or a SciPy
+        sparse matrix, without building an SFrame.
+
+        Parameters
+        ----------
+        field, index, value : array-like
+          The field, feature id and value of each node, stored row after
+          row. The extension runs in its own process, so they are written
+          to a temporary directory as raw int32, int32 and float32 files,
+          which it maps and reads in place.
+
+        indptr : array-like
+          Row i consists of the nodes indptr[i] up to indptr[i+1], as in
+          scipy.sparse.csr_matrix.
+
+        label : array-like
+          One label per row; rows with a label above 0 are positive.
+
+        validation_set : tuple, optional
+          (field, index, value, indptr, label) arrays of a validation set.
+
+        Unlike with fit, the field of a node is taken from `field` rather
+        than from the column it is in. The remaining parameters are the
+        same as for fit.
+
+        Returns
+        -------
+          None
+        """
+
+        if auto_stop and validation_set is None:
+            raise ValueError, "auto_stop requires a validation_set."
+        self.m.set_param(nr_iters, nr_threads, quiet, random, sparse,
+                         auto_stop, patience, batch_size)
+        tmp = tempfile.mkdtemp(prefix='ffm')
+        try:
+            train = os.path.join(tmp, 'train')
+            self._write_arrays(train, field, index, value, indptr, label)
+            self.m.set_arrays('train', train)
+            if validation_set is not None:
+                valid = os.path.join(tmp, 'valid')
+                self._write_arrays(valid, *validation_set)
+                self.m.set_arrays('valid', valid)
+        finally:
+            shutil.rmtree(tmp)
+        if checkpoint_path is None:
+            checkpoint_path = ''
+        if resume_path is None:
+            resume_path = ''
+        self.m.fit_arrays(checkpoint_path, checkpoint_interval, resume_path,
+                          warm_start)
+
+    def predict_arrays(self, field, index, value, indptr):
+        """
+        Make predictions for rows in CSR form, laid out as for fit_arrays.
+
+        Returns
+        -------
+
+        out : numpy.ndarray
+          A float32 array with one prediction per row.
+        """
+
+        import numpy as np
+        tmp = tempfile.mkdtemp(prefix='ffm')
+        try:
+            test = os.path.join(tmp, 'test')
+            self._write_arrays(test, field, index, value, indptr)
+            self.m.predict_arrays(test, test + '.out')
+            return np.fromfile(test + '.out', dtype=np.float32)
+        finally:
+            shutil.rmtree(tmp)
+
+    def _write_arrays(self, prefix, field, index, value, indptr, label=None):
+        # The extension cannot read this process's memory, so the arrays go
+        # to <prefix>.field etc. in the layout ffm_read_array_files() maps.
+        import numpy as np
+        arrays = [np.ascontiguousarray(field, dtype=np.int32),
+                  np.ascontiguousarray(index, dtype=np.int32),
+                  np.ascontiguousarray(value, dtype=np.float32),
+                  np.ascontiguousarray(indptr, dtype=np.int64)]
+        if len(arrays[3]) == 0 or arrays[3][0] < 0 or \
+           len(arrays[0]) < arrays[3][-1] or \
+           not len(arrays[0]) == len(arrays[1]) == len(arrays[2]):
+            raise ValueError, "field, index and value must cover indptr."
+        names = ['field', 'index', 'value', 'indptr']
+        if label is not None:
+            arrays.append(np.ascontiguousarray(label, dtype=np.float32))
+            names.append('label')
+            if len(arrays[4]) != len(arrays[3]) - 1:
+                raise ValueError, "label must have one entry per row."
+        for name, a in zip(names, arrays):
+            a.tofile(prefix + '.' + name)
 
     def predict(self, test):
         """
@@ -119,3 +286,17 @@ class FFM(object):
         """
 
         return self.m.predict(test)
+
+    def load_model(self, filename):
+        """
+        Load a model written by ffm-train, in either the binary or the text
+        format. Call fit with warm_start=True to continue training it.
+
+        Parameters
+        ----------
+
+        filename : str
+          Path to the model file.
+        """
+
+        self.m.load_model(filename)
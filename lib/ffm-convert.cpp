@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "ffm.h"
+
+using namespace std;
+using namespace ffm;
+
+struct Option
+{
+    Option() : nr_threads(1), quiet(false) {}
+    string text_path, shard_path;
+    ffm_int nr_threads;
+    bool quiet;
+};
+
+string convert_help()
+{
+    return string(
+"usage: ffm-convert [options] text_file shard_file\n"
+"\n"
+"Converts a libffm text file into a binary shard, which ffm-train\n"
+"streams from disk instead of parsing text every run.\n"
+"\n"
+"options:\n"
+"-s <nr_threads>: set number of threads (default 1)\n"
+"--quiet: quiet mode (no output)\n");
+}
+
+Option parse_option(int argc, char **argv)
+{
+    vector<string> args;
+    for(int i = 0; i < argc; i++)
+        args.push_back(string(argv[i]));
+
+    if(argc == 1)
+        throw invalid_argument(convert_help());
+
+    Option option;
+
+    ffm_int i = 1;
+    for(; i < argc; i++)
+    {
+        if(args[i].compare("-s") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify number of threads after -s");
+            i++;
+            option.nr_threads = stoi(args[i]);
+            if(option.nr_threads <= 0)
+                throw invalid_argument("number of threads should be greater than zero");
+        }
+        else if(args[i].compare("--quiet") == 0)
+        {
+            option.quiet = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(i != argc-2)
+        throw invalid_argument("cannot parse argument");
+
+    option.text_path = string(args[i]);
+    option.shard_path = string(args[i+1]);
+
+    return option;
+}
+
+int main(int argc, char **argv)
+{
+    Option option;
+    try
+    {
+        option = parse_option(argc, argv);
+    }
+    catch(invalid_argument &e)
+    {
+        cout << e.what() << endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    ffm_long nr_rows = 0;
+    if(ffm_convert_text(option.text_path.c_str(), option.shard_path.c_str(),
+                        option.nr_threads, &nr_rows) != 0)
+    {
+        cout << "cannot convert " << option.text_path << " to " 
+             << option.shard_path << endl;
+        return 1;
+    }
+
+    if(!option.quiet)
+    {
+        chrono::duration<double> elapsed = chrono::steady_clock::now()-start;
+        double seconds = max(elapsed.count(), 1e-9);
+        struct stat st;
+        stat(option.text_path.c_str(), &st);
+        cout << "converted " << option.text_path << ": " << nr_rows 
+             << " rows, " << fixed << setprecision(0) << nr_rows/seconds 
+             << " rows/s, " << setprecision(1) << st.st_size/1e6/seconds 
+             << " MB/s" << endl;
+    }
+
+    return 0;
+}
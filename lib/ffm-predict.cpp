@@ -15,13 +15,18 @@ using namespace ffm;
 
 struct Option
 {
+    Option() : nr_threads(1) {}
     string test_path, model_path, output_path;
+    ffm_int nr_threads;
 };
 
 string predict_help()
 {
     return string(
-"usage: ffm-predict test_file model_file output_file\n");
+"usage: ffm-predict [options] test_file model_file output_file\n"
+"\n"
+"options:\n"
+"-s <nr_threads>: set number of threads (default 1)\n");
 }
 
 Option parse_option(int argc, char **argv)
@@ -35,33 +40,76 @@ Option parse_option(int argc, char **argv)
 
     Option option;
 
-    if(argc != 4)
+    ffm_int i = 1;
+    for(; i < argc; i++)
+    {
+        if(args[i].compare("-s") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify number of threads after -s");
+            i++;
+            option.nr_threads = stoi(args[i]);
+            if(option.nr_threads <= 0)
+                throw invalid_argument("number of threads should be greater than zero");
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(i != argc-3)
         throw invalid_argument("cannot parse argument");
 
-    option.test_path = string(args[1]);
-    option.model_path = string(args[2]);
-    option.output_path = string(args[3]);
+    option.test_path = string(args[i]);
+    option.model_path = string(args[i+1]);
+    option.output_path = string(args[i+2]);
 
     return option;
 }
 
-void predict(string test_path, string model_path, string output_path)
+void predict(string test_path, string model_path, string output_path, 
+             ffm_int nr_threads)
 {
     int const kMaxLineSize = 1000000;
+    ffm_int const kBatchSize = 100000;
 
     FILE *f_in = fopen(test_path.c_str(), "r");
+    if(f_in == nullptr)
+        throw runtime_error("cannot open " + test_path);
     ofstream f_out(output_path);
     char line[kMaxLineSize];
 
     ffm_model *model = ffm_load_model(model_path.c_str());
+    if(model == nullptr)
+        throw runtime_error("cannot load " + model_path);
 
     ffm_double loss = 0;
-    vector<ffm_node> x;
     ffm_int i = 0;
 
+    // Rows are parsed into a CSR batch and scored together, so the 
+    // prediction itself runs vectorized and across nr_threads.
+    vector<ffm_node> X;
+    vector<ffm_long> P(1, 0);
+    vector<ffm_float> Y, Y_bar(kBatchSize);
+
+    auto flush = [&]()
+    {
+        ffm_int l = (ffm_int)Y.size();
+        ffm_predict_batch(X.data(), P.data(), l, model, Y_bar.data(), 
+                          nr_threads);
+        for(ffm_int ii = 0; ii < l; ii++)
+        {
+            loss -= Y[ii]==1? log(Y_bar[ii]) : log(1-Y_bar[ii]);
+            f_out << Y_bar[ii] << "\n";
+        }
+        X.clear();
+        P.resize(1);
+        Y.clear();
+    };
+
     for(; fgets(line, kMaxLineSize, f_in) != nullptr; i++)
     {
-        x.clear();
         char *y_char = strtok(line, " \t");
         ffm_float y = (atoi(y_char)>0)? 1.0f : -1.0f;
 
@@ -78,15 +126,18 @@ void predict(string test_path, string model_path, string output_path)
             N.j = atoi(idx_char);
             N.v = atof(value_char);
 
-            x.push_back(N);
+            X.push_back(N);
         }
 
-        ffm_float y_bar = ffm_predict(x.data(), x.data()+x.size(), model);
-
-        loss -= y==1? log(y_bar) : log(1-y_bar);
+        P.push_back(X.size());
+        Y.push_back(y);
 
-        f_out << y_bar << "\n";
+        if((ffm_int)Y.size() == kBatchSize)
+            flush();
     }
+    flush();
+
+    fclose(f_in);
 
     loss /= i;
 
@@ -109,5 +160,14 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    predict(option.test_path, option.model_path, option.output_path);
+    try
+    {
+        predict(option.test_path, option.model_path, option.output_path, 
+                option.nr_threads);
+    }
+    catch(runtime_error const &e)
+    {
+        cout << e.what() << endl;
+        return 1;
+    }
 }
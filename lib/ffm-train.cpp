@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
 #include <stdexcept>
 #include <cstring>
 #include <vector>
+#include <sys/stat.h>
 
 #include "ffm.h"
 
@@ -13,25 +17,41 @@ string train_help()
     return string(
 "usage: ffm-train [options] training_set_file [model_file]\n"
 "\n"
+"training_set_file can be libffm text or a binary shard, which is\n"
+"streamed from disk every iteration instead of being loaded.\n"
+"\n"
 "options:\n"
 "-l <lambda>: set regularization parameter (default 0)\n"
 "-k <factor>: set number of latent factors (default 4)\n"
 "-t <iteration>: set number of iterations (default 15)\n"
 "-r <eta>: set learning rate (default 0.1)\n"
 "-s <nr_threads>: set number of threads (default 1)\n"
+"-b <batch_size>: set number of rows per gradient step (default 1)\n"
 "-p <path>: set path to the validation set\n"
 "--quiet: quiet model (no output)\n"
 "--norm: do instance-wise normalization\n"
-"--no-rand: disable random update\n");
+"--no-rand: disable random update\n"
+"--text: save the model in the text format instead of binary\n"
+"--sparse: allocate weights only for features seen in training\n"
+"--loss-interval <n>: evaluate the training loss on every n-th row only (default 1)\n"
+"--auto-stop: stop once the validation loss stops improving and keep the best model (needs -p)\n"
+"--patience <n>: set number of iterations without improvement before stopping (default 1)\n"
+"--checkpoint <path>: save weights and optimizer state to path during training\n"
+"--checkpoint-interval <n>: set number of iterations between checkpoints (default 1)\n"
+"--resume <path>: continue training from a checkpoint\n"
+"--init <path>: start from a model or checkpoint trained on earlier data\n");
 }
 
 struct Option
 {
-    Option() : param(ffm_get_default_param()), nr_folds(1), do_cv(false) {}
-    string tr_path, va_path, model_path;
+    Option() : param(ffm_get_default_param()), nr_folds(1), do_cv(false), 
+               text_model(false) {}
+    string tr_path, va_path, model_path, checkpoint_path, resume_path,
+           init_path;
     ffm_parameter param;
     ffm_int nr_folds;
     bool do_cv;
+    bool text_model;
 };
 
 Option parse_option(int argc, char **argv)
@@ -93,6 +113,15 @@ Option parse_option(int argc, char **argv)
             if(opt.param.nr_threads <= 0)
                 throw invalid_argument("number of threads should be greater than zero");
         }
+        else if(args[i].compare("-b") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify batch size after -b");
+            i++;
+            opt.param.batch_size = stoi(args[i]);
+            if(opt.param.batch_size <= 0)
+                throw invalid_argument("batch size should be greater than zero");
+        }
         else if(args[i].compare("-v") == 0)
         {
             if(i == argc-1)
@@ -122,6 +151,66 @@ Option parse_option(int argc, char **argv)
         {
             opt.param.random = false;
         }
+        else if(args[i].compare("--text") == 0)
+        {
+            opt.text_model = true;
+        }
+        else if(args[i].compare("--sparse") == 0)
+        {
+            opt.param.sparse = true;
+        }
+        else if(args[i].compare("--loss-interval") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify interval after --loss-interval");
+            i++;
+            opt.param.loss_interval = stoi(args[i]);
+            if(opt.param.loss_interval <= 0)
+                throw invalid_argument("loss interval should be greater than zero");
+        }
+        else if(args[i].compare("--auto-stop") == 0)
+        {
+            opt.param.auto_stop = true;
+        }
+        else if(args[i].compare("--patience") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify patience after --patience");
+            i++;
+            opt.param.patience = stoi(args[i]);
+            if(opt.param.patience <= 0)
+                throw invalid_argument("patience should be greater than zero");
+        }
+        else if(args[i].compare("--checkpoint") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --checkpoint");
+            i++;
+            opt.checkpoint_path = args[i];
+        }
+        else if(args[i].compare("--checkpoint-interval") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify interval after --checkpoint-interval");
+            i++;
+            opt.param.checkpoint_interval = stoi(args[i]);
+            if(opt.param.checkpoint_interval <= 0)
+                throw invalid_argument("checkpoint interval should be greater than zero");
+        }
+        else if(args[i].compare("--resume") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --resume");
+            i++;
+            opt.resume_path = args[i];
+        }
+        else if(args[i].compare("--init") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --init");
+            i++;
+            opt.init_path = args[i];
+        }
         else
         {
             break;
@@ -131,6 +220,17 @@ Option parse_option(int argc, char **argv)
     if(i != argc-2 && i != argc-1)
         throw invalid_argument("cannot parse command\n");
 
+    if(!opt.init_path.empty() && !opt.resume_path.empty())
+        throw invalid_argument("--init and --resume cannot be used together");
+
+    if(opt.do_cv && 
+       (!opt.init_path.empty() || !opt.resume_path.empty() || 
+        !opt.checkpoint_path.empty()))
+        throw invalid_argument("cross validation cannot use checkpoints or an initial model");
+
+    if(opt.param.auto_stop && opt.va_path.empty())
+        throw invalid_argument("to use auto-stop, you need to assign a validation set");
+
     opt.tr_path = args[i];
     i++;
 
@@ -155,10 +255,8 @@ Option parse_option(int argc, char **argv)
     return opt;
 }
 
-ffm_problem read_problem(string path)
+ffm_problem read_problem(string path, ffm_int nr_threads, bool quiet)
 {
-    int const kMaxLineSize = 1000000;
-
     ffm_problem prob;
     prob.l = 0;
     prob.n = 0;
@@ -166,77 +264,30 @@ ffm_problem read_problem(string path)
     prob.X = nullptr;
     prob.P = nullptr;
     prob.Y = nullptr;
+    prob.R = nullptr;
+    prob.X_mmapped = false;
 
     if(path.empty())
         return prob;
 
-    FILE *f = fopen(path.c_str(), "r");
-    if(f == nullptr)
-        throw runtime_error("cannot open " + path);
+    auto start = chrono::steady_clock::now();
 
-    char line[kMaxLineSize];
+    if(ffm_read_problem(path.c_str(), nr_threads, &prob) != 0)
+        throw runtime_error("cannot read " + path);
 
-    ffm_long nnz = 0;
-    for(ffm_int i = 0; fgets(line, kMaxLineSize, f) != nullptr; i++, prob.l++)
+    if(!quiet)
     {
-        strtok(line, " \t");
-        for(; ; nnz++)
-        {
-            char *field_char = strtok(nullptr,":");
-            strtok(nullptr,":");
-            strtok(nullptr," \t");
-            if(field_char == nullptr || *field_char == '\n')
-                break;
-        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now()-start;
+        struct stat st;
+        stat(path.c_str(), &st);
+        cout << "read " << path << ": " << prob.l << " rows, " 
+             << fixed << setprecision(1) 
+             << st.st_size/1e6/max(elapsed.count(), 1e-9) << " MB/s" << endl;
     }
-    rewind(f);
-
-    prob.X = new ffm_node[nnz];
-    prob.P = new ffm_long[prob.l+1];
-    prob.Y = new ffm_float[prob.l];
-
-    ffm_long p = 0;
-    prob.P[0] = 0;
-    for(ffm_int i = 0; fgets(line, kMaxLineSize, f) != nullptr; i++)
-    {
-        char *y_char = strtok(line, " \t");
-        ffm_float y = (atoi(y_char)>0)? 1.0f : -1.0f;
-        prob.Y[i] = y;
-
-        for(; ; ++p)
-        {
-            char *field_char = strtok(nullptr,":");
-            char *idx_char = strtok(nullptr,":");
-            char *value_char = strtok(nullptr," \t");
-            if(field_char == nullptr || *field_char == '\n')
-                break;
-
-            ffm_int field = atoi(field_char);
-            ffm_int idx = atoi(idx_char);
-            ffm_float value = atof(value_char);
-
-            prob.m = max(prob.m, field+1);
-            prob.n = max(prob.n, idx+1);
-            
-            prob.X[p].f = field;
-            prob.X[p].j = idx;
-            prob.X[p].v = value;
-        }
-        prob.P[i+1] = p;
-    }
-
-    fclose(f);
 
     return prob;
 }
 
-void destroy_problem(ffm_problem &prob)
-{
-    delete[] prob.X;
-    delete[] prob.P;
-    delete[] prob.Y;
-}
-
 int main(int argc, char **argv)
 {
     Option opt;
@@ -250,32 +301,112 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    // A binary shard is streamed from disk every epoch instead of being 
+    // read into memory.
+    bool streaming = ffm_is_shard(opt.tr_path.c_str());
+
+    if(streaming && opt.do_cv)
+    {
+        cout << "cross validation needs a text training set" << endl;
+        return 1;
+    }
+
+    if(streaming && 
+       (!opt.checkpoint_path.empty() || !opt.resume_path.empty() ||
+        !opt.init_path.empty()))
+    {
+        cout << "checkpoints and initial models need a text training set" 
+             << endl;
+        return 1;
+    }
+
+    // A checkpoint passed to --init brings its accumulators along, so it 
+    // goes in through resume_path; a model is loaded and copied.
+    ffm_model *init = nullptr;
+    if(!opt.init_path.empty())
+    {
+        if(ffm_is_checkpoint(opt.init_path.c_str()))
+        {
+            opt.resume_path = opt.init_path;
+        }
+        else
+        {
+            init = ffm_load_model(opt.init_path.c_str());
+            if(init == nullptr)
+            {
+                cout << "cannot load model from " << opt.init_path << endl;
+                return 1;
+            }
+        }
+    }
+
+    // opt is final from here on, so its strings outlive the training.
+    if(!opt.checkpoint_path.empty())
+        opt.param.checkpoint_path = opt.checkpoint_path.c_str();
+    if(!opt.resume_path.empty())
+        opt.param.resume_path = opt.resume_path.c_str();
+
     ffm_problem tr, va;
     try
     {
-        tr = read_problem(opt.tr_path);
-        va = read_problem(opt.va_path);
+        tr = read_problem(streaming ? string() : opt.tr_path, 
+                          opt.param.nr_threads, opt.param.quiet);
+        va = read_problem(opt.va_path, opt.param.nr_threads, opt.param.quiet);
     }
     catch(runtime_error &e)
     {
         cout << e.what() << endl;
+        ffm_destroy_model(&init);
         return 1;
     }
 
     if(opt.do_cv)
     {
-        ffm_cross_validation(&tr, opt.nr_folds, opt.param);
+        if(ffm_cross_validation(&tr, opt.nr_folds, opt.param) < 0)
+        {
+            cout << "cannot split " << opt.tr_path << " into " 
+                 << opt.nr_folds << " folds" << endl;
+            ffm_destroy_problem(&tr);
+            ffm_destroy_problem(&va);
+            return 1;
+        }
     }
     else
     {
-        ffm_model *model = train_with_validation(&tr, &va, opt.param);
+        ffm_model *model = nullptr;
+        if(streaming)
+        {
+            char const *path = opt.tr_path.c_str();
+            model = ffm_train_on_shards(&path, 1, &va, opt.param);
+        }
+        else if(!opt.init_path.empty())
+        {
+            model = ffm_train_incremental(init, &tr, &va, opt.param);
+        }
+        else
+        {
+            model = train_with_validation(&tr, &va, opt.param);
+        }
+
+        if(model == nullptr)
+        {
+            cout << "cannot train on " << opt.tr_path << endl;
+            ffm_destroy_problem(&tr);
+            ffm_destroy_problem(&va);
+            ffm_destroy_model(&init);
+
+            return 1;
+        }
 
-        ffm_int status = ffm_save_model(model, opt.model_path.c_str());
+        ffm_int status = opt.text_model ?
+            ffm_save_model_txt(model, opt.model_path.c_str()) :
+            ffm_save_model(model, opt.model_path.c_str());
         if(status != 0)
         {
-            destroy_problem(tr);
-            destroy_problem(va);
+            ffm_destroy_problem(&tr);
+            ffm_destroy_problem(&va);
             ffm_destroy_model(&model);
+            ffm_destroy_model(&init);
 
             return 1;
         }
@@ -283,8 +414,9 @@ int main(int argc, char **argv)
         ffm_destroy_model(&model);
     }
 
-    destroy_problem(tr);
-    destroy_problem(va);
+    ffm_destroy_problem(&tr);
+    ffm_destroy_problem(&va);
+    ffm_destroy_model(&init);
 
     return 0;
 }
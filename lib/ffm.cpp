@@ -7,13 +7,26 @@
 #include <memory>
 #include <cmath>
 #include <vector>
-#include <pmmintrin.h>
+#include <random>
+#include <string>
+#include <functional>
+#include <future>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <emmintrin.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #if defined USEOMP
 #include <omp.h>
 #endif
 
 #include "ffm.h"
+#include "ffm_kernel.h"
 
 #include <graphlab/logger/logger.hpp>
 #include <graphlab/timer/timer.hpp>
@@ -39,108 +52,36 @@ using namespace std;
 using namespace graphlab;
 
 
-ffm_int const kALIGNByte = 16;
-ffm_int const kALIGN = kALIGNByte/sizeof(ffm_float);
+// Weight blocks are allocated on cache-line boundaries, wide enough for the
+// AVX-512 kernel; k itself is only padded to the 128-bit lane width since 
+// the wider kernels finish any remainder with SSE.
+ffm_int const kALIGNByte = 64;
+ffm_int const kALIGN = 4;
 
-inline ffm_float wTx(
-    ffm_node *begin,
-    ffm_node *end,
-    ffm_float r,
-    ffm_model &model, 
-    ffm_float kappa=0, 
-    ffm_float eta=0, 
-    ffm_float lambda=0, 
-    bool do_update=false)
-{
-    ffm_long align0 = (ffm_long)model.k*2;
-    ffm_long align1 = (ffm_long)model.m*align0;
-
-    __m128 XMMkappa = _mm_set1_ps(kappa);
-    __m128 XMMeta = _mm_set1_ps(eta);
-    __m128 XMMlambda = _mm_set1_ps(lambda);
-
-    __m128 XMMt = _mm_setzero_ps();
-
-    for(ffm_node *N1 = begin; N1 != end; N1++)
-    {
-        ffm_int j1 = N1->j;
-        ffm_int f1 = N1->f;
-        ffm_float v1 = N1->v;
-        if(j1 >= model.n || f1 >= model.m)
-            continue;
-
-        for(ffm_node *N2 = N1+1; N2 != end; N2++)
-        {
-            ffm_int j2 = N2->j;
-            ffm_int f2 = N2->f;
-            ffm_float v2 = N2->v;
-            if(j2 >= model.n || f2 >= model.m || f1 == f2)
-                continue;
-
-            ffm_float *w1 = model.W + j1*align1 + f2*align0;
-            ffm_float *w2 = model.W + j2*align1 + f1*align0;
-
-            __m128 XMMv = _mm_set1_ps(2.0f*v1*v2*r);
-
-            if(do_update)
-            {
-                __m128 XMMkappav = _mm_mul_ps(XMMkappa, XMMv);
-
-                ffm_float *wg1 = w1 + model.k;
-                ffm_float *wg2 = w2 + model.k;
-                for(ffm_int d = 0; d < model.k; d += 4)
-                {
-                    __m128 XMMw1 = _mm_load_ps(w1+d);
-                    __m128 XMMw2 = _mm_load_ps(w2+d);
-
-                    __m128 XMMwg1 = _mm_load_ps(wg1+d);
-                    __m128 XMMwg2 = _mm_load_ps(wg2+d);
-
-                    __m128 XMMg1 = _mm_add_ps(
-                                   _mm_mul_ps(XMMlambda, XMMw1),
-                                   _mm_mul_ps(XMMkappav, XMMw2));
-                    __m128 XMMg2 = _mm_add_ps(
-                                   _mm_mul_ps(XMMlambda, XMMw2),
-                                   _mm_mul_ps(XMMkappav, XMMw1));
-
-                    XMMwg1 = _mm_add_ps(XMMwg1, _mm_mul_ps(XMMg1, XMMg1));
-                    XMMwg2 = _mm_add_ps(XMMwg2, _mm_mul_ps(XMMg2, XMMg2));
-
-                    XMMw1 = _mm_sub_ps(XMMw1, _mm_mul_ps(XMMeta, 
-                            _mm_mul_ps(_mm_rsqrt_ps(XMMwg1), XMMg1)));
-                    XMMw2 = _mm_sub_ps(XMMw2, _mm_mul_ps(XMMeta, 
-                            _mm_mul_ps(_mm_rsqrt_ps(XMMwg2), XMMg2)));
-
-                    _mm_store_ps(w1+d, XMMw1);
-                    _mm_store_ps(w2+d, XMMw2);
-
-                    _mm_store_ps(wg1+d, XMMwg1);
-                    _mm_store_ps(wg2+d, XMMwg2);
-                }
-            }
-            else
-            {
-                for(ffm_int d = 0; d < model.k; d += 4)
-                {
-                    __m128  XMMw1 = _mm_load_ps(w1+d);
-                    __m128  XMMw2 = _mm_load_ps(w2+d);
-
-                    XMMt = _mm_add_ps(XMMt, 
-                           _mm_mul_ps(_mm_mul_ps(XMMw1, XMMw2), XMMv));
-                }
-            }
-        }
-    }
+// Sparse models allocate their rows from slabs of this many floats.
+ffm_long const kSLAB_FLOATS = 1 << 22;
 
-    if(do_update)
-        return 0;
-
-    XMMt = _mm_hadd_ps(XMMt, XMMt);
-    XMMt = _mm_hadd_ps(XMMt, XMMt);
-    ffm_float t;
-    _mm_store_ss(&t, XMMt);
+ffm_kernel const *select_kernel()
+{
+    // FFM_ISA can force a narrower kernel, e.g. to reproduce results 
+    // bit-for-bit on hosts of different generations.
+    char const *isa = getenv("FFM_ISA");
+    string forced = isa != nullptr ? isa : "";
+
+    __builtin_cpu_init();
+    if((forced.empty() || forced == "avx512") && 
+       __builtin_cpu_supports("avx512f"))
+        return ffm_kernel_avx512();
+    if((forced.empty() || forced == "avx512" || forced == "avx2") && 
+       __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return ffm_kernel_avx2();
+    return ffm_kernel_sse();
+}
 
-    return t;
+ffm_kernel const *kernel()
+{
+    static ffm_kernel const *selected = select_kernel();
+    return selected;
 }
 
 ffm_float* malloc_aligned_float(ffm_long size)
@@ -155,6 +96,74 @@ ffm_float* malloc_aligned_float(ffm_long size)
     return (ffm_float*)ptr;
 }
 
+// Uniform [0,1) draw for weight d of block (j,f), from a SplitMix64 hash
+// of its coordinates. Unlike drand48() this keeps no state, so any thread
+// can initialize any row in any order and get the same model.
+inline ffm_float init_uniform(ffm_int j, ffm_int f, ffm_int d, ffm_int m, 
+                              ffm_int k)
+{
+    uint64_t z = ((uint64_t)j*m + f)*k + d + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (ffm_float)(z >> 40)/(1 << 24);
+}
+
+// Fills feature j's row: m weight blocks of k_aligned floats, random with
+// zero padding, then the m matching AdaGrad accumulator blocks, starting 
+// at 1.
+void init_row(
+    ffm_float *w, 
+    ffm_int j, 
+    ffm_int m, 
+    ffm_int k, 
+    ffm_int k_aligned)
+{
+    ffm_float coef = 0.5/sqrt(k);
+
+    for(ffm_int f = 0; f < m; f++)
+    {
+        for(ffm_int d = 0; d < k; d++, w++)
+            *w = coef*init_uniform(j, f, d, m, k);
+        for(ffm_int d = k; d < k_aligned; d++, w++)
+            *w = 0;
+    }
+    fill(w, w+(ffm_long)m*k_aligned, 1);
+}
+
+// Backing store of a sparse model. Rows are carved out of large slabs so
+// that allocating one costs a pointer bump rather than a malloc.
+struct model_pages
+{
+    vector<ffm_float*> slabs;
+    ffm_float *next = nullptr;
+    ffm_long left = 0;
+    ffm_long nr_rows = 0;
+    ffm_long capacity = 0;
+
+    ~model_pages()
+    {
+        for(ffm_float *slab : slabs)
+            free(slab);
+    }
+
+    ffm_float* allocate(ffm_long size)
+    {
+        if(size > left)
+        {
+            left = max(size, kSLAB_FLOATS);
+            next = malloc_aligned_float(left);
+            slabs.push_back(next);
+            capacity += left;
+        }
+        ffm_float *ptr = next;
+        next += size;
+        left -= size;
+        nr_rows++;
+        return ptr;
+    }
+};
+
 ffm_model* init_model(ffm_int n, ffm_int m, ffm_parameter param)
 {
     ffm_int k_aligned = (ffm_int)ceil((ffm_double)param.k/kALIGN)*kALIGN;
@@ -164,7 +173,25 @@ ffm_model* init_model(ffm_int n, ffm_int m, ffm_parameter param)
     model->k = k_aligned;
     model->m = m;
     model->W = nullptr;
+    model->mapped = nullptr;
+    model->mapped_size = 0;
+    model->rows = nullptr;
+    model->pages = nullptr;
     model->normalization = param.normalization;
+
+    // A sparse model starts out empty; touch_rows() allocates each 
+    // feature the first time the training data uses it.
+    if(param.sparse)
+    {
+        model->rows = (ffm_float**)calloc(max(n, 1), sizeof(ffm_float*));
+        if(model->rows == nullptr)
+        {
+            ffm_destroy_model(&model);
+            throw bad_alloc();
+        }
+        model->pages = new model_pages;
+        return model;
+    }
     
     try
     {
@@ -176,232 +203,2328 @@ ffm_model* init_model(ffm_int n, ffm_int m, ffm_parameter param)
         throw;
     }
 
-    ffm_float coef = 0.5/sqrt(param.k);
-    ffm_float *w = model->W;
+    // W comes back untouched from the allocator, so initializing it with 
+    // the training threads both spreads the work and places each page on 
+    // the NUMA node of a thread that will update it.
+    ffm_long align1 = (ffm_long)m*k_aligned*2;
+#if defined USEOMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(ffm_int j = 0; j < model->n; j++)
+        init_row(model->W + j*align1, j, m, param.k, k_aligned);
+
+    return model;
+}
+
+// Allocates and initializes feature j's row in a sparse model.
+ffm_float* alloc_row(ffm_model &model, ffm_int j, ffm_parameter const &param)
+{
+    model_pages &pages = *(model_pages*)model.pages;
+    model.rows[j] = pages.allocate((ffm_long)model.m*model.k*2);
+    init_row(model.rows[j], j, model.m, param.k, model.k);
+    return model.rows[j];
+}
+
+// Gives every feature of the rows in order its rows in a sparse model. 
+// Rows outside order, such as a held-out fold, must not get any, or their
+// features would predict with random weights instead of not at all. This
+// runs before each SGD pass so that the Hogwild threads only ever read 
+// the row table.
+void touch_rows(
+    ffm_model &model, 
+    ffm_node *X, 
+    ffm_long *P, 
+    vector<ffm_int> const &order, 
+    ffm_parameter const &param)
+{
+    if(model.rows == nullptr)
+        return;
+
+    for(ffm_int i : order)
+    {
+        for(ffm_long p = P[i]; p < P[i+1]; p++)
+        {
+            ffm_int j = X[p].j;
+            if((uint32_t)j < (uint32_t)model.n && model.rows[j] == nullptr)
+                alloc_row(model, j, param);
+        }
+    }
+}
+
+void log_pages(ffm_model &model)
+{
+    if(model.rows == nullptr)
+        return;
+
+    model_pages &pages = *(model_pages*)model.pages;
+    ffm_double mb = ((ffm_double)pages.capacity*sizeof(ffm_float) + 
+                     (ffm_double)model.n*sizeof(ffm_float*))/(1<<20);
+    logprogress_stream << "sparse model: " << pages.nr_rows << " of " 
+                       << model.n << " features, " << fixed 
+                       << setprecision(1) << mb << " MB" << endl;
+}
+
+void shrink_model(ffm_model &model, ffm_int k_new)
+{
+    ffm_long align1 = (ffm_long)model.m*model.k*2;
+    for(ffm_int j = 0; j < model.n; j++)
+    {
+        // The weights already lead each row, so sparse rows only need 
+        // their padding squeezed out; dense ones also slide down to close 
+        // up W.
+        ffm_float *src_row = model_row(model, j, align1);
+        ffm_float *dst_row = model.rows != nullptr ? 
+                             src_row : model.W + (ffm_long)j*model.m*k_new;
+        if(src_row == nullptr || (src_row == dst_row && k_new == model.k))
+            continue;
+
+        for(ffm_int f = 0; f < model.m; f++)
+        {
+            ffm_float *src = src_row + (ffm_long)f*model.k;
+            ffm_float *dst = dst_row + (ffm_long)f*k_new;
+            copy(src, src+k_new, dst);
+        }
+    }
+
+    model.k = k_new;
+}
+
+// Instance-wise normalization factor 1/||x|| from the squared norm. A row
+// with no nonzero values is left unscaled rather than given an infinite 
+// scale, which would turn the weights it updates into NaN.
+inline ffm_float norm_scale(ffm_float norm)
+{
+    return norm > 0 ? 1/sqrt(norm) : 1;
+}
+
+inline ffm_float norm_scale(ffm_node *begin, ffm_node *end)
+{
+    ffm_float r = 0;
+    for(ffm_node *N = begin; N != end; N++)
+        r += N->v*N->v; 
+    return norm_scale(r);
+}
+
+// The scales are computed along with X when a problem is read or 
+// materialized; this covers problems put together by hand.
+void fill_row_scales(ffm_problem *prob)
+{
+    if(prob == nullptr || prob->R != nullptr || prob->X == nullptr)
+        return;
+
+    prob->R = new ffm_float[prob->l];
+    for(ffm_int i = 0; i < prob->l; i++)
+        prob->R[i] = norm_scale(&prob->X[prob->P[i]], &prob->X[prob->P[i+1]]);
+}
+
+// Number of rows whose nodes take up about kSHUFFLE_BLOCK_BYTES, i.e. 
+// roughly what fits in L2.
+ffm_int shuffle_block_size(ffm_long *P, ffm_int l)
+{
+    ffm_long const kSHUFFLE_BLOCK_BYTES = 512*1024;
+
+    if(l == 0)
+        return 1;
+    ffm_long row_bytes = max((ffm_long)1, P[l]*(ffm_long)sizeof(ffm_node)/l);
+    return (ffm_int)max((ffm_long)64, kSHUFFLE_BLOCK_BYTES/row_bytes);
+}
+
+// Rows are shuffled in blocks of consecutive entries of base_order, and 
+// then within each block, so an epoch is still a series of sweeps over 
+// small regions of X rather than a random walk over all of it. Blocks are
+// always cut from base_order so their boundaries stay fixed across epochs.
+void block_shuffle(
+    vector<ffm_int> const &base_order, 
+    ffm_int block_size, 
+    vector<ffm_int> &order, 
+    mt19937 &rng)
+{
+    ffm_int nr_blocks = ((ffm_int)base_order.size()+block_size-1)/block_size;
+    vector<ffm_int> blocks(nr_blocks);
+    for(ffm_int b = 0; b < nr_blocks; b++)
+        blocks[b] = b;
+    shuffle(blocks.begin(), blocks.end(), rng);
+
+    order.resize(base_order.size());
+    auto dst = order.begin();
+    for(ffm_int b : blocks)
+    {
+        auto src = base_order.begin() + (ffm_long)b*block_size;
+        auto src_end = b == nr_blocks-1 ? base_order.end() : src + block_size;
+        auto dst_end = copy(src, src_end, dst);
+        shuffle(dst, dst_end, rng);
+        dst = dst_end;
+    }
+}
+
+// e^x for four floats, to within 3e-7 relative error for x in [-87, 88] 
+// and clamped outside it so the loss never sees inf. x is split into 
+// i*ln(2) + r, with i built straight into the exponent bits and e^r taken
+// from a degree-6 polynomial on |r| <= ln(2)/2.
+inline __m128 fast_exp(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_set1_ps(88.0f));
+
+    __m128i i = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)));
+    __m128 fi = _mm_cvtepi32_ps(i);
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(fi, _mm_set1_ps(0.693145752f)));
+    r = _mm_sub_ps(r, _mm_mul_ps(fi, _mm_set1_ps(1.42860677e-6f)));
+
+    __m128 p = _mm_set1_ps(1.0f/720);
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f/120));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f/24));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f/6));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(0.5f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f));
+
+    __m128i bits = _mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+
+// log(1+x) for four floats x >= 0, to within 2e-7 relative error when the
+// result is above 1 and 2e-7 absolute error below: 1+x = 2^e*m with m in 
+// [sqrt(1/2), sqrt(2)), and log(m) = 2*atanh(s), s = (m-1)/(m+1), from 
+// its odd series.
+inline __m128 fast_log1p(__m128 x)
+{
+    __m128 one = _mm_set1_ps(1.0f);
+
+    __m128i bits = _mm_castps_si128(_mm_add_ps(one, x));
+    __m128i e = _mm_srai_epi32(
+        _mm_sub_epi32(bits, _mm_set1_epi32(0x3f3504f3)), 23);
+    __m128 m = _mm_castsi128_ps(_mm_sub_epi32(bits, _mm_slli_epi32(e, 23)));
+
+    __m128 s = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+    __m128 s2 = _mm_mul_ps(s, s);
+    __m128 p = _mm_set1_ps(1.0f/9);
+    p = _mm_add_ps(_mm_mul_ps(p, s2), _mm_set1_ps(1.0f/7));
+    p = _mm_add_ps(_mm_mul_ps(p, s2), _mm_set1_ps(1.0f/5));
+    p = _mm_add_ps(_mm_mul_ps(p, s2), _mm_set1_ps(1.0f/3));
+    p = _mm_add_ps(_mm_mul_ps(p, s2), one);
+
+    return _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(e), _mm_set1_ps(0.693147181f)),
+                      _mm_mul_ps(_mm_add_ps(s, s), p));
+}
+
+// Summed logistic loss log(1+e^(-y*t)) of l scores, four at a time. The
+// sums are kept in double so long validation sets do not lose precision.
+ffm_double logistic_losses(ffm_float const *Y, ffm_float const *T, ffm_int l)
+{
+    __m128d sum_lo = _mm_setzero_pd(), sum_hi = _mm_setzero_pd();
+    ffm_int i = 0;
+    for(; i+4 <= l; i += 4)
+    {
+        __m128 nyt = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), 
+                                           _mm_loadu_ps(Y+i)), 
+                                _mm_loadu_ps(T+i));
+        __m128 loss = fast_log1p(fast_exp(nyt));
+        sum_lo = _mm_add_pd(sum_lo, _mm_cvtps_pd(loss));
+        sum_hi = _mm_add_pd(sum_hi, _mm_cvtps_pd(_mm_movehl_ps(loss, loss)));
+    }
+
+    ffm_double sum[2];
+    _mm_storeu_pd(sum, _mm_add_pd(sum_lo, sum_hi));
+    ffm_double loss = sum[0] + sum[1];
+    for(; i < l; i++)
+        loss += log(1+exp(-Y[i]*T[i]));
+    return loss;
+}
+
+// For l scores t with labels y, the logistic loss log(1+e^(-y*t)) of each
+// into loss and its derivative in t, -y*e^(-y*t)/(1+e^(-y*t)), into kappa,
+// four at a time. kappa may be T itself.
+void logistic_grads(
+    ffm_float const *Y, 
+    ffm_float const *T, 
+    ffm_float *kappa, 
+    ffm_float *loss, 
+    ffm_int l)
+{
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    ffm_int i = 0;
+    for(; i+4 <= l; i += 4)
+    {
+        __m128 ny = _mm_sub_ps(zero, _mm_loadu_ps(Y+i));
+        __m128 e = fast_exp(_mm_mul_ps(ny, _mm_loadu_ps(T+i)));
+        _mm_storeu_ps(loss+i, fast_log1p(e));
+        _mm_storeu_ps(kappa+i, _mm_div_ps(_mm_mul_ps(ny, e), 
+                                          _mm_add_ps(one, e)));
+    }
+    for(; i < l; i++)
+    {
+        ffm_float e = exp(-Y[i]*T[i]);
+        loss[i] = log(1+e);
+        kappa[i] = -Y[i]*e/(1+e);
+    }
+}
+
+// Turns l scores into probabilities 1/(1+e^(-t)) in place.
+void logistic(ffm_float *T, ffm_int l)
+{
+    __m128 one = _mm_set1_ps(1.0f);
+    ffm_int i = 0;
+    for(; i+4 <= l; i += 4)
+    {
+        __m128 t = _mm_loadu_ps(T+i);
+        _mm_storeu_ps(T+i, _mm_div_ps(one, _mm_add_ps(one, 
+            fast_exp(_mm_sub_ps(_mm_setzero_ps(), t)))));
+    }
+    for(; i < l; i++)
+        T[i] = 1/(1+exp(-T[i]));
+}
+
+// Owns the memory behind an ffm_grad_buffer.
+struct grad_scratch
+{
+    vector<ffm_int> index;
+    vector<ffm_float*> rows;
+    vector<ffm_long> slots;
+    ffm_float *G = nullptr;
+    ffm_long capacity = 0;
+    ffm_grad_buffer buf;
+
+    ~grad_scratch() { free(G); }
+
+    // Makes room for nr_rows distinct model rows of size floats, with the
+    // table at most half full.
+    ffm_grad_buffer &reserve(ffm_long nr_rows, ffm_long size)
+    {
+        if(nr_rows > capacity)
+        {
+            ffm_long table_size = 1;
+            while(table_size < 2*nr_rows)
+                table_size *= 2;
+
+            index.assign(table_size, -1);
+            rows.resize(nr_rows);
+            slots.resize(nr_rows);
+            free(G);
+            G = nullptr;
+            G = malloc_aligned_float(nr_rows*size);
+            capacity = nr_rows;
+
+            buf.mask = table_size-1;
+            buf.index = index.data();
+            buf.rows = rows.data();
+            buf.slots = slots.data();
+            buf.G = G;
+            buf.nr_used = 0;
+        }
+        return buf;
+    }
+};
+
+// Mini-batch version of sgd_pass() below: each thread splits its range of rows
+// into batches of param.batch_size, sums the gradients of a batch, and 
+// then takes one AdaGrad step per weight block the batch touched. Blocks 
+// shared by many rows, like those of a constant feature, are then written
+// once per batch rather than once per row. The weights stay fixed until 
+// that step, so a batch is scored first and its losses and kappas come 
+// out of one vectorized pass before the gradient kernels run.
+ffm_double minibatch_pass(
+    ffm_node *X,
+    ffm_long *P,
+    ffm_float *Y,
+    ffm_float const *R,
+    vector<ffm_int> const &order,
+    ffm_model &model,
+    ffm_wTx wTx,
+    ffm_parameter const &param)
+{
+    ffm_grad grad = ffm_kernel_grad(kernel(), model.k);
+    ffm_apply apply = kernel()->apply;
+
+    ffm_double tr_loss = 0;
+    ffm_int nr_rows = (ffm_int)order.size();
+    ffm_int loss_interval = max(1, param.loss_interval);
+
+#if defined USEOMP
+#pragma omp parallel reduction(+: tr_loss)
+#endif
+    {
+#if defined USEOMP
+        ffm_int nr_threads = omp_get_num_threads();
+        ffm_int thread = omp_get_thread_num();
+#else
+        ffm_int nr_threads = 1;
+        ffm_int thread = 0;
+#endif
+        ffm_int ii_begin = (ffm_long)nr_rows*thread/nr_threads;
+        ffm_int ii_end = (ffm_long)nr_rows*(thread+1)/nr_threads;
+
+        grad_scratch scratch;
+        vector<ffm_float> Yb(param.batch_size), T(param.batch_size), 
+                          loss(param.batch_size);
+
+        for(ffm_int batch = ii_begin; batch < ii_end; 
+            batch += param.batch_size)
+        {
+            ffm_int batch_end = min(batch+param.batch_size, ii_end);
+
+            // A batch touches at most one model row per node.
+            ffm_long nr_nodes = 0;
+            for(ffm_int ii = batch; ii < batch_end; ii++)
+                nr_nodes += P[order[ii]+1]-P[order[ii]];
+            ffm_grad_buffer &buf = scratch.reserve(
+                max(min(nr_nodes, (ffm_long)model.n), (ffm_long)1), 
+                (ffm_long)model.m*model.k);
+
+            for(ffm_int ii = batch; ii < batch_end; ii++)
+            {
+                ffm_int i = order[ii];
+                ffm_float r = R != nullptr ? R[i] : 1;
+                Yb[ii-batch] = Y[i];
+                T[ii-batch] = wTx(&X[P[i]], &X[P[i+1]], r, model, 
+                                  0, 0, 0, false);
+            }
+
+            // T becomes the kappas.
+            logistic_grads(Yb.data(), T.data(), T.data(), loss.data(), 
+                           batch_end-batch);
+
+            for(ffm_int ii = batch; ii < batch_end; ii++)
+            {
+                ffm_int i = order[ii];
+
+                ffm_node *begin = &X[P[i]];
+
+                ffm_node *end = &X[P[i+1]];
+
+                ffm_float r = R != nullptr ? R[i] : 1;
+
+                if(loss_interval == 1 || ii % loss_interval == 0)
+                    tr_loss += loss[ii-batch];
+
+                grad(begin, end, r, model, T[ii-batch], buf);
+            }
+
+            apply(buf, model, param.eta, param.lambda);
+        }
+    }
+
+    ffm_int nr_sampled = (nr_rows+loss_interval-1)/loss_interval;
+    return nr_sampled > 0 ? tr_loss*nr_rows/nr_sampled : 0;
+}
+
+// One SGD pass over the listed rows of X/P/Y; returns the summed loss.
+// R holds the rows' normalization scales, or is nullptr for none.
+// With param.loss_interval above 1 the loss is only evaluated on every 
+// loss_interval-th row and scaled up to the whole pass.
+//
+// Hogwild: each thread takes a contiguous range of rows and updates the 
+// shared model without locking. Two rows rarely touch the same (j,f) 
+// blocks, so the occasional lost update does not hurt convergence.
+ffm_double sgd_pass(
+    ffm_node *X,
+    ffm_long *P,
+    ffm_float *Y,
+    ffm_float const *R,
+    vector<ffm_int> const &order,
+    ffm_model &model,
+    ffm_wTx wTx,
+    ffm_parameter const &param)
+{
+    if(param.batch_size > 1)
+        return minibatch_pass(X, P, Y, R, order, model, wTx, param);
+
+    ffm_double tr_loss = 0;
+    ffm_int nr_rows = (ffm_int)order.size();
+    ffm_int loss_interval = max(1, param.loss_interval);
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static) reduction(+: tr_loss)
+#endif
+    for(ffm_int ii = 0; ii < nr_rows; ii++)
+    {
+        ffm_int i = order[ii];
+
+        ffm_float y = Y[i];
+
+        ffm_node *begin = &X[P[i]];
+
+        ffm_node *end = &X[P[i+1]];
+
+        ffm_float r = R != nullptr ? R[i] : 1;
+
+        ffm_float t = wTx(begin, end, r, model, 0, 0, 0, false);
+
+        ffm_float expnyt = exp(-y*t);
+
+        if(loss_interval == 1 || ii % loss_interval == 0)
+            tr_loss += log(1+expnyt);
+
+        ffm_float kappa = -y*expnyt/(1+expnyt);
+
+        wTx(begin, end, r, model, kappa, param.eta, param.lambda, true);
+    }
+
+    ffm_int nr_sampled = (nr_rows+loss_interval-1)/loss_interval;
+    return nr_sampled > 0 ? tr_loss*nr_rows/nr_sampled : 0;
+}
+
+ffm_double va_logloss(ffm_problem *va, ffm_model &model, ffm_wTx wTx)
+{
+    ffm_int const kBATCH = 256;
+
+    ffm_double va_loss = 0;
+
+    // Scores are collected a batch at a time so that the loss can be taken
+    // four rows per instruction. The pass is read-only, so the batches can
+    // be shared out among the threads training used.
+#if defined USEOMP
+#pragma omp parallel for schedule(static) reduction(+: va_loss)
+#endif
+    for(ffm_int i0 = 0; i0 < va->l; i0 += kBATCH)
+    {
+        ffm_float T[kBATCH];
+        ffm_int l = min(kBATCH, va->l-i0);
+        for(ffm_int i = i0; i < i0+l; i++)
+        {
+            ffm_node *begin = &va->X[va->P[i]];
+
+            ffm_node *end = &va->X[va->P[i+1]];
+
+            ffm_float r = model.normalization ? va->R[i] : 1;
+
+            T[i-i0] = wTx(begin, end, r, model, 0, 0, 0, false);
+        }
+
+        va_loss += logistic_losses(va->Y+i0, T, l);
+    }
+
+    return va_loss/va->l;
+}
+
+shared_ptr<ffm_model> create_model(ffm_int n, ffm_int m, ffm_parameter param)
+{
+    return shared_ptr<ffm_model>(init_model(n, m, param),
+                [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+}
+
+void log_header(ffm_problem *va)
+{
+    logprogress_stream << "using " << kernel()->name << " kernel" << endl;
+
+    stringstream ss;
+    ss << setw(4) << "iter"
+       << setw(13) << "tr_logloss";
+    if(va != nullptr && va->l != 0)
+    {
+        ss << setw(13) << "va_logloss";
+    }
+    ss << endl;
+
+    logprogress_stream << ss.str() << endl; 
+}
+
+void log_iter(
+    ffm_int iter, 
+    ffm_double tr_loss, 
+    ffm_problem *va, 
+    ffm_double va_loss)
+{
+    stringstream ss;
+    ss << setw(4) << iter 
+       << setw(13) << fixed 
+       << setprecision(5) << tr_loss;
+    if(va != nullptr && va->l != 0)
+    {
+        ss << setw(13) << fixed << setprecision(5) << va_loss;
+    }
+    ss << endl;
+    logprogress_stream << ss.str() << endl;
+}
+
+void log_throughput(ffm_double nr_rows, ffm_double time, ffm_int nr_threads)
+{
+    if(time <= 0)
+        return;
+    logprogress_stream << "trained " << fixed << setprecision(0) 
+                       << nr_rows/time << " rows/s with " << nr_threads 
+                       << " thread(s)" << endl;
+}
+
+// Early stopping for param.auto_stop. The weights of the epoch with the 
+// lowest validation loss are copied aside whenever it improves and put 
+// back once training stops, so the model returned is the best one seen 
+// rather than the last.
+struct early_stop
+{
+    ffm_double best_va_loss = HUGE_VAL;
+    ffm_int best_iter = -1;
+    ffm_int last_iter = -1;
+
+    // Weights only: the accumulators are dropped by shrink_model() anyway.
+    // ids lists the features a sparse model had rows for.
+    vector<ffm_int> ids;
+    vector<ffm_float> W;
+
+    // Returns true when training should stop after this epoch.
+    bool update(
+        ffm_int iter, 
+        ffm_double va_loss, 
+        ffm_model &model, 
+        ffm_parameter const &param)
+    {
+        last_iter = iter;
+        if(va_loss < best_va_loss)
+        {
+            best_va_loss = va_loss;
+            best_iter = iter;
+            take(model);
+            return false;
+        }
+        return iter-best_iter >= max(1, param.patience);
+    }
+
+    void take(ffm_model &model)
+    {
+        ffm_long size = (ffm_long)model.m*model.k;
+        ids.clear();
+        W.clear();
+        for(ffm_int j = 0; j < model.n; j++)
+        {
+            ffm_float *row = model_row(model, j, size*2);
+            if(row == nullptr)
+                continue;
+            if(model.rows != nullptr)
+                ids.push_back(j);
+            W.insert(W.end(), row, row+size);
+        }
+    }
+
+    // Rows a sparse model only gained after the best epoch go back to 
+    // their initial values, which is what they held at that point.
+    void finish(ffm_model &model, ffm_parameter const &param)
+    {
+        if(best_iter < 0 || best_iter == last_iter)
+            return;
+
+        ffm_long size = (ffm_long)model.m*model.k;
+        auto src = W.begin();
+        auto id = ids.begin();
+        for(ffm_int j = 0; j < model.n; j++)
+        {
+            ffm_float *row = model_row(model, j, size*2);
+            if(row == nullptr)
+                continue;
+            if(model.rows != nullptr && (id == ids.end() || *id != j))
+            {
+                init_row(row, j, model.m, param.k, model.k);
+                continue;
+            }
+            copy(src, src+size, row);
+            src += size;
+            if(model.rows != nullptr)
+                id++;
+        }
+
+        if(!param.quiet)
+            logprogress_stream << "auto-stop: using the model of iter " 
+                               << best_iter << endl;
+    }
+};
+
+// Moves the weights out of a model owned by a shared_ptr into one the 
+// caller owns.
+ffm_model* release_model(ffm_model &model)
+{
+    ffm_model *model_ret = new ffm_model;
+
+    model_ret->n = model.n;
+    model_ret->m = model.m;
+    model_ret->k = model.k;
+    model_ret->normalization = model.normalization;
+
+    model_ret->W = model.W;
+    model_ret->mapped = nullptr;
+    model_ret->mapped_size = 0;
+    model_ret->rows = model.rows;
+    model_ret->pages = model.pages;
+    model.W = nullptr;
+    model.rows = nullptr;
+    model.pages = nullptr;
+
+    return model_ret;
+}
+
+// Checkpoint layout: a kCHECKPOINT_HEADER_SIZE-byte header, the ids of 
+// the stored rows if the model is sparse, the RNG state as text, and then
+// each stored row in full, accumulators included, so that training can 
+// carry on exactly where it stopped.
+char const kCHECKPOINT_MAGIC[8] = {'L', 'I', 'B', 'F', 'F', 'M', 'K', '\0'};
+uint32_t const kCHECKPOINT_VERSION = 1;
+size_t const kCHECKPOINT_HEADER_SIZE = 64;
+
+struct checkpoint_header
+{
+    char magic[8];
+    uint32_t version;
+    int32_t n;
+    int32_t m;
+    int32_t k;
+    int32_t param_k;
+    int32_t normalization;
+    int32_t epoch;
+    int32_t sparse;
+    int64_t nr_rows;
+    uint64_t rng_size;
+};
+
+static_assert(sizeof(checkpoint_header) <= kCHECKPOINT_HEADER_SIZE, 
+              "checkpoint_header does not fit in kCHECKPOINT_HEADER_SIZE");
+
+// Writes checkpoints in a background thread. save() only has to copy the 
+// model, which is far quicker than writing it, so training goes on while 
+// the previous copy reaches the disk. Each file is written under a 
+// temporary name and renamed when complete, so a crash mid-write leaves 
+// the previous checkpoint intact.
+class checkpoint_writer
+{
+public:
+    checkpoint_writer(char const *path) : path(path) {}
+
+    ~checkpoint_writer() { wait(); }
+
+    void save(
+        ffm_model &model, 
+        ffm_parameter const &param, 
+        ffm_int epoch, 
+        mt19937 const &rng)
+    {
+        wait();
+
+        ffm_long size = (ffm_long)model.m*model.k*2;
+
+        ids.clear();
+        W.clear();
+        for(ffm_int j = 0; j < model.n; j++)
+        {
+            ffm_float *row = model_row(model, j, size);
+            if(row == nullptr)
+                continue;
+            if(model.rows != nullptr)
+                ids.push_back(j);
+            W.insert(W.end(), row, row+size);
+        }
+
+        stringstream ss;
+        ss << rng;
+        rng_state = ss.str();
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, kCHECKPOINT_MAGIC, sizeof(header.magic));
+        header.version = kCHECKPOINT_VERSION;
+        header.n = model.n;
+        header.m = model.m;
+        header.k = model.k;
+        header.param_k = param.k;
+        header.normalization = model.normalization;
+        header.epoch = epoch;
+        header.sparse = model.rows != nullptr;
+        header.nr_rows = ids.size();
+        header.rng_size = rng_state.size();
+
+        pending = async(launch::async, [this] () { return write(); });
+    }
+
+    // Waits for the checkpoint being written, if any.
+    void wait()
+    {
+        if(!pending.valid())
+            return;
+        if(!pending.get())
+            logprogress_stream << "cannot write checkpoint " << path << endl;
+    }
+
+private:
+    bool write()
+    {
+        string tmp_path = path + ".tmp";
+        FILE *f = fopen(tmp_path.c_str(), "wb");
+        if(f == nullptr)
+            return false;
+
+        char pad[kCHECKPOINT_HEADER_SIZE] = {0};
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                  fwrite(pad, kCHECKPOINT_HEADER_SIZE-sizeof(header), 1, f) 
+                    == 1 &&
+                  fwrite(ids.data(), sizeof(int32_t), ids.size(), f) == 
+                    ids.size() &&
+                  fwrite(rng_state.data(), 1, rng_state.size(), f) == 
+                    rng_state.size() &&
+                  fwrite(W.data(), sizeof(ffm_float), W.size(), f) == 
+                    W.size();
+
+        if(fclose(f) != 0 || !ok)
+            return false;
+
+        return rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+
+    string path;
+    future<bool> pending;
+
+    checkpoint_header header;
+    vector<int32_t> ids;
+    string rng_state;
+    vector<ffm_float> W;
+};
+
+bool read_checkpoint_header(FILE *f, checkpoint_header &header)
+{
+    char pad[kCHECKPOINT_HEADER_SIZE];
+    return fread(&header, sizeof(header), 1, f) == 1 &&
+           fread(pad, kCHECKPOINT_HEADER_SIZE-sizeof(header), 1, f) == 1 &&
+           memcmp(header.magic, kCHECKPOINT_MAGIC, sizeof(header.magic)) 
+             == 0 &&
+           header.version == kCHECKPOINT_VERSION &&
+           header.n >= 0 && header.m >= 0 && header.k >= 0 &&
+           header.nr_rows >= 0 && header.nr_rows <= header.n;
+}
+
+// Restores a checkpoint into a model freshly created for the same data and
+// parameters. Returns the number of epochs the checkpoint had completed, 
+// or -1 if it cannot be read or does not fit the model. With grow set, 
+// the model may also have more features and fields than the checkpoint, 
+// as when training continues on new data; those keep their initial values.
+ffm_int load_checkpoint(
+    char const *path, 
+    ffm_model &model, 
+    ffm_parameter const &param, 
+    mt19937 &rng,
+    bool grow)
+{
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return -1;
+
+    checkpoint_header header;
+    bool ok = read_checkpoint_header(f, header) &&
+              header.k == model.k && header.param_k == param.k &&
+              (header.normalization != 0) == model.normalization &&
+              (grow ? header.n <= model.n && header.m <= model.m :
+                      header.n == model.n && header.m == model.m);
+
+    vector<int32_t> ids(ok ? header.nr_rows : 0);
+    string rng_state(ok ? header.rng_size : 0, '\0');
+    ok = ok && 
+         fread(ids.data(), sizeof(int32_t), ids.size(), f) == ids.size() &&
+         fread(&rng_state[0], 1, rng_state.size(), f) == rng_state.size();
+
+    // Either kind of checkpoint can go into either kind of model: a dense
+    // one gives a sparse model every row, and features missing from a 
+    // sparse one keep their initial values in a dense model.
+    ffm_long size = (ffm_long)header.m*header.k*2;
+    ffm_long nr_rows = header.sparse ? header.nr_rows : header.n;
+    vector<ffm_float> buffer(size);
+    for(ffm_long i = 0; ok && i < nr_rows; i++)
+    {
+        ffm_int j = header.sparse ? ids[i] : (ffm_int)i;
+        ok = j >= 0 && j < model.n &&
+             fread(buffer.data(), sizeof(ffm_float), size, f) == (size_t)size;
+        if(!ok)
+            break;
+
+        ffm_float *row = model_row(model, j, (ffm_long)model.m*model.k*2);
+        if(row == nullptr)
+            row = alloc_row(model, j, param);
+
+        // The weight blocks, then the accumulator blocks, of each field.
+        ffm_long block = (ffm_long)header.m*header.k;
+        for(ffm_int f = 0; f < header.m; f++)
+        {
+            ffm_float *src = buffer.data() + (ffm_long)f*header.k;
+            ffm_float *dst = row + (ffm_long)f*model.k;
+            copy(src, src+model.k, dst);
+            copy(src+block, src+block+model.k, 
+                 dst+(ffm_long)model.m*model.k);
+        }
+    }
+
+    fclose(f);
+    if(!ok)
+        return -1;
+
+    stringstream ss(rng_state);
+    ss >> rng;
+
+    return header.epoch;
+}
+
+// Copies the weights of init, a trained model, into a model freshly 
+// created for training, which may have more features and fields. The 
+// accumulators keep their initial values, since init has none.
+bool warm_start(ffm_model &model, ffm_model const &init, ffm_parameter const &param)
+{
+    // The weights were fit to inputs scaled one way; training them further
+    // on inputs scaled the other way would mix the two.
+    if(init.k != param.k || init.n > model.n || init.m > model.m ||
+       init.normalization != param.normalization)
+        return false;
+
+    for(ffm_int j = 0; j < init.n; j++)
+    {
+        ffm_float const *src = model_row(init, j, (ffm_long)init.m*init.k);
+        if(src == nullptr)
+            continue;
+
+        ffm_float *dst = model_row(model, j, (ffm_long)model.m*model.k*2);
+        if(dst == nullptr)
+            dst = alloc_row(model, j, param);
+
+        for(ffm_int f = 0; f < init.m; f++)
+            copy(src + (ffm_long)f*init.k, src + (ffm_long)(f+1)*init.k, 
+                 dst + (ffm_long)f*model.k);
+    }
+
+    return true;
+}
+
+// Grows n and m to cover the checkpoint at path, if it can be read.
+void fit_checkpoint(char const *path, ffm_int &n, ffm_int &m)
+{
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return;
+
+    checkpoint_header header;
+    if(read_checkpoint_header(f, header))
+    {
+        n = max(n, (ffm_int)header.n);
+        m = max(m, (ffm_int)header.m);
+    }
+    fclose(f);
+}
+
+// With warm set, training continues from init's weights, or from the 
+// checkpoint at param.resume_path with its accumulators, rather than from 
+// scratch, on data that may have new features; it then runs 
+// param.nr_iters epochs however many the checkpoint had done.
+shared_ptr<ffm_model> train(
+    ffm_problem *tr, 
+    vector<ffm_int> &order, 
+    ffm_parameter param, 
+    ffm_problem *va=nullptr,
+    bool warm=false,
+    ffm_model const *init=nullptr)
+{
+#if defined USEOMP
+    ffm_int old_nr_threads = omp_get_max_threads();
+    omp_set_num_threads(param.nr_threads);
+#endif
+
+    ffm_int n = tr->n, m = tr->m;
+    if(init != nullptr)
+    {
+        n = max(n, init->n);
+        m = max(m, init->m);
+    }
+    if(warm && param.resume_path != nullptr)
+        fit_checkpoint(param.resume_path, n, m);
+
+    shared_ptr<ffm_model> model = create_model(n, m, param);
+    touch_rows(*model, tr->X, tr->P, order, param);
+
+    fill_row_scales(tr);
+    fill_row_scales(va);
+    ffm_float const *R = param.normalization ? tr->R : nullptr;
+
+    mt19937 rng;
+
+    bool ok = true;
+    if(init != nullptr && !warm_start(*model, *init, param))
+    {
+        logprogress_stream << "the initial model does not fit the "
+                              "parameters" << endl;
+        ok = false;
+    }
+
+    ffm_int first_iter = 0;
+    if(ok && param.resume_path != nullptr)
+    {
+        ffm_int epoch = load_checkpoint(param.resume_path, *model, param, 
+                                        rng, warm);
+        if(epoch < 0)
+        {
+            logprogress_stream << "cannot resume from " << param.resume_path
+                               << endl;
+            ok = false;
+        }
+        else if(!warm)
+        {
+            first_iter = epoch;
+        }
+    }
+
+    if(!ok)
+    {
+#if defined USEOMP
+        omp_set_num_threads(old_nr_threads);
+#endif
+        return nullptr;
+    }
+
+    unique_ptr<checkpoint_writer> checkpoint;
+    if(param.checkpoint_path != nullptr)
+        checkpoint.reset(new checkpoint_writer(param.checkpoint_path));
+
+    ffm_wTx wTx = ffm_kernel_wTx(kernel(), model->k);
+
+    if(!param.quiet)
+        log_header(va);
+
+    ffm_int nr_rows = (ffm_int)order.size();
+
+    ffm_int block_size = shuffle_block_size(tr->P, tr->l);
+    vector<ffm_int> base_order(order);
+
+    timer tr_timer;
+    ffm_double tr_time = 0;
+
+    bool has_va = va != nullptr && va->l != 0;
+    bool auto_stop = param.auto_stop && has_va;
+    early_stop stop;
+
+    ffm_int nr_epochs = 0;
+    for(ffm_int iter = first_iter; iter < param.nr_iters; iter++)
+    {
+        nr_epochs = iter+1-first_iter;
+
+        if(param.random)
+            block_shuffle(base_order, block_size, order, rng);
+
+        tr_timer.start();
+
+        ffm_double tr_loss = 
+            sgd_pass(tr->X, tr->P, tr->Y, R, order, *model, wTx, param);
+
+        tr_time += tr_timer.current_time();
+
+        ffm_double va_loss = 0;
+        if(has_va && (auto_stop || !param.quiet))
+            va_loss = va_logloss(va, *model, wTx);
+
+        if(!param.quiet)
+            log_iter(iter, tr_loss/nr_rows, va, va_loss);
+
+        if(checkpoint && (iter+1) % max(1, param.checkpoint_interval) == 0)
+            checkpoint->save(*model, param, iter+1, rng);
+
+        if(auto_stop && stop.update(iter, va_loss, *model, param))
+            break;
+    }
+
+    if(checkpoint)
+        checkpoint->wait();
+
+    if(auto_stop)
+        stop.finish(*model, param);
+
+    if(!param.quiet)
+    {
+        log_throughput((ffm_double)nr_rows*nr_epochs, tr_time, 
+                       param.nr_threads);
+        log_pages(*model);
+    }
+
+#if defined USEOMP
+    omp_set_num_threads(old_nr_threads);
+#endif
+
+    shrink_model(*model, param.k);
+
+    return model;
+}
+
+// Binary model layout: a kMODEL_HEADER_SIZE-byte header followed by the 
+// raw W block, so that W sits on a cache-line boundary once the file is
+// mapped and can be used in place. A sparse model (version 2, nr_rows > 0)
+// puts the ids of its nr_rows features between the two, padded to the 
+// same boundary, and stores only those features' blocks.
+char const kMODEL_MAGIC[8] = {'L', 'I', 'B', 'F', 'F', 'M', 'B', '\0'};
+uint32_t const kMODEL_VERSION = 2;
+size_t const kMODEL_HEADER_SIZE = 64;
+
+struct model_header
+{
+    char magic[8];
+    uint32_t version;
+    int32_t n;
+    int32_t m;
+    int32_t k;
+    int32_t normalization;
+    uint32_t align;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+    int64_t nr_rows;
+};
+
+static_assert(sizeof(model_header) <= kMODEL_HEADER_SIZE, 
+              "model_header does not fit in kMODEL_HEADER_SIZE");
+
+// Fletcher-64 over the 32-bit words of the weights, fed one block of 
+// floats at a time. The sums are reduced once per kBlock words, which is 
+// as long as they can go without overflowing.
+struct model_checksum
+{
+    uint64_t s1 = 0, s2 = 0;
+
+    void add(ffm_float const *W, ffm_long nr_floats)
+    {
+        ffm_long const kBlock = 8192;
+
+        uint32_t const *p = (uint32_t const*)W;
+        for(ffm_long i = 0; i < nr_floats; i += kBlock)
+        {
+            ffm_long i_end = min(i+kBlock, nr_floats);
+            for(ffm_long ii = i; ii < i_end; ii++)
+            {
+                s1 += p[ii];
+                s2 += s1;
+            }
+            s1 %= 0xffffffffULL;
+            s2 %= 0xffffffffULL;
+        }
+    }
+
+    uint64_t value() const { return (s2 << 32) | s1; }
+};
+
+ffm_long align_up(ffm_long size, ffm_long align)
+{
+    return (size+align-1)/align*align;
+}
+
+// Builds a model over ptr, a mapping of size bytes that holds a whole 
+// binary model, and takes it over: it is unmapped when the model is 
+// destroyed, or right away if the header does not check out.
+// Whether header describes a model that fits in size bytes, with n, m, k 
+// and the block size agreeing and W aligned for the SIMD kernels, which 
+// load it with aligned loads of up to 16 bytes.
+bool valid_model_header(model_header const &header, uint64_t size)
+{
+    if(header.version < 1 || header.version > kMODEL_VERSION ||
+       header.n < 0 || header.m < 0 || header.k < 0 || header.nr_rows < 0 ||
+       header.align < 16 || (header.align & (header.align-1)) != 0 ||
+       header.offset % header.align != 0 ||
+       header.offset > size || header.size > size-header.offset)
+        return false;
+
+    // Version 1 files leave nr_rows zeroed as part of the header padding.
+    ffm_long nr_rows = header.nr_rows > 0 ? header.nr_rows : header.n;
+    ffm_long align1 = (ffm_long)header.m*header.k;
+    ffm_long ids_end = kMODEL_HEADER_SIZE;
+    if(header.nr_rows > 0)
+        ids_end += header.nr_rows*sizeof(int32_t);
+    return nr_rows <= header.n &&
+           (align1 == 0 || 
+            (uint64_t)nr_rows <= header.size/sizeof(ffm_float)/align1) &&
+           header.size == (uint64_t)nr_rows*align1*sizeof(ffm_float) &&
+           header.offset >= (uint64_t)ids_end;
+}
+
+ffm_model* model_from_mapping(void *ptr, size_t size)
+{
+    model_header const *header = (model_header const*)ptr;
+    if(!valid_model_header(*header, size))
+    {
+        munmap(ptr, size);
+        return nullptr;
+    }
+
+    ffm_model *model = new ffm_model;
+    model->n = header->n;
+    model->m = header->m;
+    model->k = header->k;
+    model->normalization = header->normalization != 0;
+    model->W = (ffm_float*)((char*)ptr + header->offset);
+    model->mapped = ptr;
+    model->mapped_size = size;
+    model->rows = nullptr;
+    model->pages = nullptr;
+
+    if(header->nr_rows > 0)
+    {
+        model->rows = (ffm_float**)calloc(max(model->n, 1), 
+                                          sizeof(ffm_float*));
+        if(model->rows == nullptr)
+        {
+            ffm_destroy_model(&model);
+            return nullptr;
+        }
+
+        int32_t const *ids = (int32_t const*)((char*)ptr+kMODEL_HEADER_SIZE);
+        ffm_long align1 = (ffm_long)model->m*model->k;
+        for(ffm_long i = 0; i < header->nr_rows; i++)
+        {
+            if(ids[i] < 0 || ids[i] >= model->n)
+            {
+                ffm_destroy_model(&model);
+                return nullptr;
+            }
+            model->rows[ids[i]] = model->W + i*align1;
+        }
+        model->W = nullptr;
+    }
+
+    return model;
+}
+
+// Maps a binary model copy-on-write: nothing is parsed or copied, pages 
+// are faulted in as predictions touch them, and a caller that keeps 
+// training on the model only duplicates the pages it writes.
+ffm_model* load_model_bin(char const *path)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < kMODEL_HEADER_SIZE)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void *ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, 
+                     MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(ptr == MAP_FAILED)
+        return nullptr;
+
+    return model_from_mapping(ptr, st.st_size);
+}
+
+// Shard layout: a kSHARD_HEADER_SIZE-byte shard_header, then chunks that 
+// each consist of a shard_chunk_header, Y[l], P[l+1] (starting at 0) and 
+// X[nnz]. Chunks are self-contained so they can be streamed one at a time.
+char const kSHARD_MAGIC[8] = {'L', 'I', 'B', 'F', 'F', 'M', 'D', '\0'};
+uint32_t const kSHARD_VERSION = 1;
+size_t const kSHARD_HEADER_SIZE = 64;
+ffm_long const kSHARD_CHUNK_NODES = 1 << 22;
+
+struct shard_header
+{
+    char magic[8];
+    uint32_t version;
+    int32_t n;
+    int32_t m;
+    int32_t reserved;
+    int64_t l;
+    int64_t nnz;
+    int64_t nr_chunks;
+};
+
+struct shard_chunk_header
+{
+    int32_t l;
+    int32_t reserved;
+    int64_t nnz;
+};
+
+bool read_shard_header(FILE *f, shard_header &header)
+{
+    return fread(&header, sizeof(header), 1, f) == 1 &&
+           memcmp(header.magic, kSHARD_MAGIC, sizeof(header.magic)) == 0 &&
+           header.version == kSHARD_VERSION &&
+           fseek(f, kSHARD_HEADER_SIZE, SEEK_SET) == 0;
+}
+
+struct shard_chunk
+{
+    ffm_int l;
+    vector<ffm_float> Y;
+    vector<ffm_long> P;
+    vector<ffm_node> X;
+    vector<ffm_float> R;
+};
+
+// Reads the chunks of a list of shards in sequence. Only one read may be
+// in flight at a time; the buffers of a chunk are reused by the next read
+// into it, so after the first pass no allocation happens.
+class shard_stream
+{
+public:
+    shard_stream() : f(nullptr), next_path(0) {}
+
+    ~shard_stream()
+    {
+        if(f != nullptr)
+            fclose(f);
+    }
+
+    void reset(vector<string> const &paths_)
+    {
+        if(f != nullptr)
+            fclose(f);
+        f = nullptr;
+        paths = paths_;
+        next_path = 0;
+    }
+
+    // Returns false once every chunk of every shard has been read.
+    bool read(shard_chunk &chunk)
+    {
+        while(true)
+        {
+            if(f == nullptr)
+            {
+                if(next_path == paths.size())
+                    return false;
+                string const &path = paths[next_path++];
+                f = fopen(path.c_str(), "rb");
+                shard_header header;
+                if(f == nullptr || !read_shard_header(f, header))
+                    log_and_throw("cannot read shard " + path);
+            }
+
+            shard_chunk_header header;
+            if(fread(&header, sizeof(header), 1, f) != 1)
+            {
+                fclose(f);
+                f = nullptr;
+                continue;
+            }
+
+            string const &path = paths[next_path-1];
+            if(header.l < 0 || header.nnz < 0)
+                log_and_throw("corrupt shard " + path);
+
+            chunk.l = header.l;
+            chunk.Y.resize(header.l);
+            chunk.P.resize(header.l+1);
+            chunk.X.resize(header.nnz);
+            if(fread(chunk.Y.data(), sizeof(ffm_float), header.l, f) != 
+                 (size_t)header.l ||
+               fread(chunk.P.data(), sizeof(ffm_long), header.l+1, f) != 
+                 (size_t)header.l+1 ||
+               fread(chunk.X.data(), sizeof(ffm_node), header.nnz, f) != 
+                 (size_t)header.nnz)
+                log_and_throw("truncated shard " + path);
+
+            // The offsets index X below and in training, so they have to 
+            // stay inside the chunk.
+            bool valid = chunk.P[0] == 0 && chunk.P[chunk.l] == header.nnz;
+            for(ffm_int i = 0; valid && i < chunk.l; i++)
+                valid = chunk.P[i] <= chunk.P[i+1];
+            if(!valid)
+                log_and_throw("corrupt shard " + path);
+
+            // Shards do not store the scales; they are cheap next to the 
+            // read, which is off the training thread anyway.
+            chunk.R.resize(header.l);
+            for(ffm_int i = 0; i < chunk.l; i++)
+                chunk.R[i] = norm_scale(&chunk.X[chunk.P[i]], 
+                                        &chunk.X[chunk.P[i+1]]);
+            return true;
+        }
+    }
+
+private:
+    FILE *f;
+    vector<string> paths;
+    size_t next_path;
+};
+
+// Hand-rolled scanners for the libffm text format. They accept exactly
+// what the format needs (optionally signed decimal integers, and decimals
+// with an optional exponent) and stop at the first character that does 
+// not fit.
+inline bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline char const* scan_int(char const *p, char const *end, ffm_long &x)
+{
+    bool negative = false;
+    if(p != end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    ffm_long val = 0;
+    for(; p != end && *p >= '0' && *p <= '9'; p++)
+        val = val*10 + (*p-'0');
+    x = negative ? -val : val;
+    return p;
+}
+
+inline char const* scan_float(char const *p, char const *end, ffm_float &x)
+{
+    static double const kPow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+
+    bool negative = false;
+    if(p != end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    ffm_int nr_digits = 0, exponent = 0;
+    for(; p != end && *p >= '0' && *p <= '9'; p++)
+    {
+        if(nr_digits < 18)
+        {
+            mantissa = mantissa*10 + (*p-'0');
+            if(mantissa != 0)
+                nr_digits++;
+        }
+        else
+        {
+            exponent++;
+        }
+    }
+    if(p != end && *p == '.')
+    {
+        for(p++; p != end && *p >= '0' && *p <= '9'; p++)
+        {
+            if(nr_digits < 18)
+            {
+                mantissa = mantissa*10 + (*p-'0');
+                if(mantissa != 0)
+                    nr_digits++;
+                exponent--;
+            }
+        }
+    }
+    if(p != end && (*p == 'e' || *p == 'E'))
+    {
+        ffm_long e;
+        p = scan_int(p+1, end, e);
+        exponent += (ffm_int)e;
+    }
+
+    double val = (double)mantissa;
+    if(exponent < 0)
+        val = -exponent <= 18 ? val/kPow10[-exponent] : val*pow(10.0, exponent);
+    else if(exponent > 0)
+        val = exponent <= 18 ? val*kPow10[exponent] : val*pow(10.0, exponent);
+    x = (ffm_float)(negative ? -val : val);
+    return p;
+}
+
+// The rows parsed from one line-aligned range of a text file, with P 
+// relative to the start of the piece.
+struct text_piece
+{
+    vector<ffm_node> X;
+    vector<ffm_long> P;
+    vector<ffm_float> Y;
+    ffm_int n;
+    ffm_int m;
+};
+
+// Returns false if a node has a field or index outside [0, 2^31), which 
+// the rest of the library cannot index with.
+bool parse_text(char const *p, char const *end, text_piece &piece)
+{
+    bool ok = true;
+    piece.n = 0;
+    piece.m = 0;
+    piece.P.assign(1, 0);
+
+    while(p != end)
+    {
+        while(p != end && is_blank(*p))
+            p++;
+        if(p == end)
+            break;
+        if(*p == '\n')
+        {
+            p++;
+            continue;
+        }
+
+        ffm_long y;
+        p = scan_int(p, end, y);
+        while(p != end && *p != '\n' && !is_blank(*p))
+            p++;
+        piece.Y.push_back(y > 0 ? 1.0f : -1.0f);
+
+        while(true)
+        {
+            while(p != end && is_blank(*p))
+                p++;
+            if(p == end || *p == '\n')
+                break;
+
+            ffm_long field, idx;
+            ffm_node N;
+            p = scan_int(p, end, field);
+            if(p != end && *p == ':')
+                p++;
+            p = scan_int(p, end, idx);
+            if(p != end && *p == ':')
+                p++;
+            p = scan_float(p, end, N.v);
+            while(p != end && *p != '\n' && !is_blank(*p))
+                p++;
+
+            ok = ok && field >= 0 && field <= INT32_MAX && 
+                 idx >= 0 && idx <= INT32_MAX;
+            N.f = (ffm_int)field;
+            N.j = (ffm_int)idx;
+            piece.m = max(piece.m, N.f+1);
+            piece.n = max(piece.n, N.j+1);
+            piece.X.push_back(N);
+        }
+        piece.P.push_back(piece.X.size());
+    }
+
+    return ok;
+}
+
+// Cuts [begin, end) into nr_pieces ranges that start at line beginnings,
+// returned as nr_pieces+1 bounds; some ranges may be empty, e.g. when the
+// text is shorter than nr_pieces bytes.
+vector<char const*> split_lines(
+    char const *begin, 
+    char const *end, 
+    ffm_int nr_pieces)
+{
+    vector<char const*> bounds(1, begin);
+    for(ffm_int i = 1; i < nr_pieces; i++)
+    {
+        char const *p = max(bounds.back(), begin + (end-begin)/nr_pieces*i);
+        while(p != begin && p != end && *(p-1) != '\n')
+            p++;
+        bounds.push_back(p);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+// Maps a file for reading; data is nullptr for an empty file.
+bool map_file(char const *path, char const *&data, size_t &size)
+{
+    data = nullptr;
+    size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    size = st.st_size;
+
+    if(size > 0)
+    {
+        void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(ptr == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        madvise(ptr, size, MADV_SEQUENTIAL);
+        data = (char const*)ptr;
+    }
+    close(fd);
+
+    return true;
+}
+
+// Column-oriented SFrame decoding. Each column is read on its own, so the
+// type of a column is checked once rather than per row, keys and values 
+// are converted in a tight loop per dict, and the nodes are scattered 
+// straight into an array sized beforehand from the dict lengths instead of 
+// being appended one at a time. The node for column c gets field c.
+
+bool decode_labels(gl_sarray const &col, size_t begin, size_t end, ffm_float *Y)
+{
+    if(col.dtype() != flex_type_enum::INTEGER)
+        return false;
+
+    auto r = col.range_iterator(begin, end);
+    for(auto const &y : r)
+        *Y++ = y.get<flex_int>() > 0 ? 1.0f : -1.0f;
+    return true;
+}
+
+// Adds the number of nodes in rows [begin, end) of col to counts[0..).
+bool count_dict_column(
+    gl_sarray const &col, 
+    size_t begin, 
+    size_t end, 
+    ffm_long *counts)
+{
+    if(col.dtype() != flex_type_enum::DICT)
+        return false;
+
+    auto r = col.range_iterator(begin, end);
+    for(auto const &d : r)
+    {
+        if(d.get_type() == flex_type_enum::DICT)
+            *counts += d.get<flex_dict>().size();
+        counts++;
+    }
+    return true;
+}
+
+// Writes the nodes of rows [begin, end) of col at X[cursor[i]], advancing
+// each row's cursor, and adds their squared values to norm[i] unless norm
+// is nullptr.
+void decode_dict_column(
+    gl_sarray const &col, 
+    ffm_int field,
+    size_t begin, 
+    size_t end, 
+    ffm_node *X,
+    ffm_long *cursor,
+    ffm_float *norm)
+{
+    auto r = col.range_iterator(begin, end);
+    size_t i = 0;
+    for(auto it = r.begin(); it != r.end(); ++it, ++i)
+    {
+        if(it->get_type() != flex_type_enum::DICT)
+            continue;
+
+        flex_dict const &dv = it->get<flex_dict>();
+        ffm_node *N = X + cursor[i];
+        ffm_float sum = 0;
+        for(auto const &kvp : dv)
+        {
+            N->f = field;
+            N->j = (ffm_int)kvp.first.get<flex_int>();
+            N->v = kvp.second.get_type() == flex_type_enum::FLOAT ?
+                   (ffm_float)kvp.second.get<flex_float>() :
+                   (ffm_float)kvp.second;
+            sum += N->v*N->v;
+            N++;
+        }
+        cursor[i] += dv.size();
+        if(norm != nullptr)
+            norm[i] += sum;
+    }
+}
+
+} // unnamed namespace
+
+ffm_int ffm_read_problem(char const *path, ffm_int nr_threads, ffm_problem *prob)
+{
+    prob->l = 0;
+    prob->n = 0;
+    prob->m = 0;
+    prob->X = nullptr;
+    prob->P = nullptr;
+    prob->Y = nullptr;
+    prob->R = nullptr;
+    prob->X_mmapped = false;
+
+    char const *data;
+    size_t size;
+    if(!map_file(path, data, size))
+        return 1;
+
+    // Cut the file into a few line-aligned ranges per thread so that a 
+    // range full of long lines does not hold up the rest.
+    nr_threads = max(1, nr_threads);
+    ffm_int nr_pieces = (size >> 20) > 0 ? nr_threads*4 : 1;
+    vector<char const*> bounds = split_lines(data, data+size, nr_pieces);
+
+    vector<text_piece> pieces(nr_pieces);
+    bool ok = true;
+#if defined USEOMP
+#pragma omp parallel for schedule(dynamic) num_threads(nr_threads) \
+    reduction(&&: ok)
+#endif
+    for(ffm_int i = 0; i < nr_pieces; i++)
+        ok = parse_text(bounds[i], bounds[i+1], pieces[i]) && ok;
+
+    if(size > 0)
+        munmap((void*)data, size);
+
+    if(!ok)
+        return 1;
+
+    // Merge: every piece is copied to its final offset in parallel.
+    vector<ffm_long> row_offsets(nr_pieces+1, 0), node_offsets(nr_pieces+1, 0);
+    for(ffm_int i = 0; i < nr_pieces; i++)
+    {
+        row_offsets[i+1] = row_offsets[i] + pieces[i].Y.size();
+        node_offsets[i+1] = node_offsets[i] + pieces[i].X.size();
+        prob->n = max(prob->n, pieces[i].n);
+        prob->m = max(prob->m, pieces[i].m);
+    }
+
+    prob->l = (ffm_int)row_offsets[nr_pieces];
+    prob->X = new ffm_node[node_offsets[nr_pieces]];
+    prob->P = new ffm_long[prob->l+1];
+    prob->Y = new ffm_float[prob->l];
+    prob->R = new ffm_float[prob->l];
+    prob->P[0] = 0;
+
+#if defined USEOMP
+#pragma omp parallel for schedule(dynamic) num_threads(nr_threads)
+#endif
+    for(ffm_int i = 0; i < nr_pieces; i++)
+    {
+        text_piece &piece = pieces[i];
+        copy(piece.X.begin(), piece.X.end(), prob->X + node_offsets[i]);
+        copy(piece.Y.begin(), piece.Y.end(), prob->Y + row_offsets[i]);
+        for(size_t ii = 1; ii < piece.P.size(); ii++)
+            prob->P[row_offsets[i]+ii] = node_offsets[i] + piece.P[ii];
+        for(ffm_long ii = row_offsets[i]; ii < row_offsets[i+1]; ii++)
+            prob->R[ii] = norm_scale(&prob->X[prob->P[ii]], 
+                                     &prob->X[prob->P[ii+1]]);
+        vector<ffm_node>().swap(piece.X);
+    }
+
+    return 0;
+}
+
+struct ffm_shard_writer
+{
+    FILE *f;
+    shard_header header;
+};
+
+ffm_shard_writer* ffm_open_shard_writer(char const *path)
+{
+    FILE *f = fopen(path, "wb");
+    if(f == nullptr)
+        return nullptr;
+
+    ffm_shard_writer *writer = new ffm_shard_writer;
+    writer->f = f;
+    memset(&writer->header, 0, sizeof(writer->header));
+    memcpy(writer->header.magic, kSHARD_MAGIC, sizeof(kSHARD_MAGIC));
+    writer->header.version = kSHARD_VERSION;
+
+    // The header is rewritten with the final counts on close.
+    char pad[kSHARD_HEADER_SIZE] = {0};
+    if(fwrite(pad, kSHARD_HEADER_SIZE, 1, f) != 1)
+    {
+        fclose(f);
+        delete writer;
+        return nullptr;
+    }
+
+    return writer;
+}
+
+ffm_int ffm_write_shard_chunk(
+    ffm_shard_writer *writer, 
+    ffm_node *X, 
+    ffm_long *P, 
+    ffm_float *Y, 
+    ffm_int l)
+{
+    if(l == 0)
+        return 0;
+
+    ffm_node *begin = X + P[0];
+    ffm_node *end = X + P[l];
+
+    shard_chunk_header chunk_header;
+    chunk_header.l = l;
+    chunk_header.reserved = 0;
+    chunk_header.nnz = end-begin;
+
+    vector<ffm_long> P_chunk(P, P+l+1);
+    for(ffm_long &p : P_chunk)
+        p -= P[0];
+
+    for(ffm_node *N = begin; N != end; N++)
+    {
+        writer->header.n = max(writer->header.n, N->j+1);
+        writer->header.m = max(writer->header.m, N->f+1);
+    }
+    writer->header.l += l;
+    writer->header.nnz += chunk_header.nnz;
+    writer->header.nr_chunks++;
+
+    FILE *f = writer->f;
+    if(fwrite(&chunk_header, sizeof(chunk_header), 1, f) != 1 ||
+       fwrite(Y, sizeof(ffm_float), l, f) != (size_t)l ||
+       fwrite(P_chunk.data(), sizeof(ffm_long), l+1, f) != (size_t)l+1 ||
+       fwrite(begin, sizeof(ffm_node), end-begin, f) != (size_t)(end-begin))
+        return 1;
+
+    return 0;
+}
+
+ffm_int ffm_close_shard_writer(ffm_shard_writer **writer)
+{
+    if(writer == nullptr || *writer == nullptr)
+        return 1;
+
+    FILE *f = (*writer)->f;
+    bool ok = fseek(f, 0, SEEK_SET) == 0 &&
+              fwrite(&(*writer)->header, sizeof(shard_header), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+
+    delete *writer;
+    *writer = nullptr;
+
+    return ok ? 0 : 1;
+}
+
+ffm_int ffm_convert_text(
+    char const *text_path, 
+    char const *shard_path, 
+    ffm_int nr_threads,
+    ffm_long *nr_rows)
+{
+    // The file goes through in windows of this many bytes per thread, so
+    // only one window's worth of parsed rows is ever held in memory.
+    size_t const kWindowBytes = 64 << 20;
+
+    if(nr_rows != nullptr)
+        *nr_rows = 0;
+
+    char const *data;
+    size_t size;
+    if(!map_file(text_path, data, size))
+        return 1;
+
+    ffm_shard_writer *writer = ffm_open_shard_writer(shard_path);
+    if(writer == nullptr)
+    {
+        if(size > 0)
+            munmap((void*)data, size);
+        return 1;
+    }
+
+    nr_threads = max(1, nr_threads);
+    ffm_int nr_pieces = nr_threads*4;
+    vector<text_piece> pieces(nr_pieces);
 
-    for(ffm_int j = 0; j < model->n; j++)
+    ffm_int status = 0;
+    char const *end = data+size;
+    for(char const *begin = data; begin != end && status == 0; )
     {
-        for(ffm_int f = 0; f < model->m; f++)
+        char const *window_end = 
+            begin + min(kWindowBytes*nr_threads, (size_t)(end-begin));
+        while(window_end != end && *(window_end-1) != '\n')
+            window_end++;
+
+        vector<char const*> bounds = 
+            split_lines(begin, window_end, nr_pieces);
+
+        bool ok = true;
+#if defined USEOMP
+#pragma omp parallel for schedule(dynamic) num_threads(nr_threads) \
+    reduction(&&: ok)
+#endif
+        for(ffm_int i = 0; i < nr_pieces; i++)
+            ok = parse_text(bounds[i], bounds[i+1], pieces[i]) && ok;
+        if(!ok)
+            status = 1;
+
+        // Pieces are written in file order, each split into chunks of at 
+        // most kSHARD_CHUNK_NODES nodes like ffm_save_problem() does.
+        for(text_piece &piece : pieces)
         {
-            for(ffm_int d = 0; d < param.k; d++, w++)
-                *w = coef*drand48();
-            for(ffm_int d = param.k; d < k_aligned; d++, w++)
-                *w = 0;
-            for(ffm_int d = k_aligned; d < 2*k_aligned; d++, w++)
-                *w = 1;
+            ffm_int l = (ffm_int)piece.Y.size();
+            for(ffm_int i = 0; i < l && status == 0; )
+            {
+                ffm_int i_end = i+1;
+                while(i_end < l && 
+                      piece.P[i_end+1]-piece.P[i] <= kSHARD_CHUNK_NODES)
+                    i_end++;
+                status = ffm_write_shard_chunk(writer, piece.X.data(), 
+                                               piece.P.data()+i, 
+                                               piece.Y.data()+i, i_end-i);
+                i = i_end;
+            }
+            if(nr_rows != nullptr)
+                *nr_rows += l;
+            piece.X.clear();
+            piece.Y.clear();
         }
+
+        // The window has been consumed; let its pages go.
+        char const *page = (char const*)((uintptr_t)begin & ~(uintptr_t)4095);
+        madvise((void*)page, window_end-page, MADV_DONTNEED);
+        begin = window_end;
     }
 
-    return model;
+    if(size > 0)
+        munmap((void*)data, size);
+
+    if(ffm_close_shard_writer(&writer) != 0)
+        status = 1;
+
+    return status;
 }
 
-void shrink_model(ffm_model &model, ffm_int k_new)
+ffm_int ffm_save_problem(ffm_problem *prob, char const *path)
 {
-    for(ffm_int j = 0; j < model.n; j++)
+    ffm_shard_writer *writer = ffm_open_shard_writer(path);
+    if(writer == nullptr)
+        return 1;
+
+    ffm_int status = 0;
+    for(ffm_int i = 0; i < prob->l && status == 0; )
     {
-        for(ffm_int f = 0; f < model.m; f++)
-        {
-            ffm_float *src = model.W + (j*model.m+f)*model.k*2;
-            ffm_float *dst = model.W + (j*model.m+f)*k_new;
-            copy(src, src+k_new, dst);
-        }
+        ffm_int i_end = i+1;
+        while(i_end < prob->l && 
+              prob->P[i_end+1]-prob->P[i] <= kSHARD_CHUNK_NODES)
+            i_end++;
+        status = ffm_write_shard_chunk(writer, prob->X, prob->P+i, 
+                                       prob->Y+i, i_end-i);
+        i = i_end;
     }
 
-    model.k = k_new;
+    if(ffm_close_shard_writer(&writer) != 0)
+        status = 1;
+
+    return status;
 }
 
-shared_ptr<ffm_model> train(
-    ffm_problem *tr, 
-    vector<ffm_int> &order, 
-    ffm_parameter param, 
-    ffm_problem *va=nullptr)
+bool ffm_is_shard(char const *path)
 {
-#if defined USEOMP
-    ffm_int old_nr_threads = omp_get_num_threads();
-    omp_set_num_threads(param.nr_threads);
-#endif
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return false;
+    shard_header header;
+    bool is_shard = read_shard_header(f, header);
+    fclose(f);
+    return is_shard;
+}
 
-    shared_ptr<ffm_model> model = 
-        shared_ptr<ffm_model>(init_model(tr->n, tr->m, param),
-            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+bool ffm_is_checkpoint(char const *path)
+{
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return false;
+    checkpoint_header header;
+    bool is_checkpoint = read_checkpoint_header(f, header);
+    fclose(f);
+    return is_checkpoint;
+}
 
+ffm_int ffm_materialize_problem(ffm_problem *prob, char const *spill_path)
+{
+    // Rows are decoded in blocks, so that the nodes being scattered to stay
+    // within a small window of X even when it is a mapped spill file.
+    size_t const kDecodeBlock = 1 << 16;
 
-    if(!param.quiet)
-    {
-        stringstream ss;
-        ss << setw(4) << "iter"
-           << setw(13) << "tr_logloss";
-        if(va != nullptr && va->l != 0)
-        {
-            ss << setw(13) << "va_logloss";
-        }
-        ss << endl;
+    size_t target_col_idx = get_column_index(prob->sf, prob->target_column);
 
-        logprogress_stream << ss.str() << endl; 
+    std::vector<size_t> feature_col_idxs;
+    std::vector<gl_sarray> feature_cols;
+    for (auto col : prob->feature_columns) {
+      feature_col_idxs.push_back(get_column_index(prob->sf, col));
+      feature_cols.push_back(prob->sf.select_column(col));
     }
 
-    size_t target_col_idx = get_column_index(tr->sf, tr->target_column); 
-    // logprogress_stream << tr->target_column << " " << get_column_index(tr->sf, tr->target_column) << std::endl;
-    // logprogress_stream << flex_type_enum_to_name(tr->sf.select_column(tr->target_column).dtype()) << std::endl;
-
-    std::vector<size_t> feature_col_idxs;
-    for (auto col : tr->feature_columns) { 
-      // logprogress_stream << col << " " << get_column_index(tr->sf, col) << std::endl;
-      // logprogress_stream << flex_type_enum_to_name(tr->sf.select_column(col).dtype()) << std::endl;
+    prob->l = prob->sf.size();
+    prob->X = nullptr;
+    prob->X_mmapped = false;
+    prob->P = new ffm_long[prob->l+1];
+    prob->Y = new ffm_float[prob->l];
+    prob->R = new ffm_float[prob->l];
+
+    // An empty problem, e.g. a missing validation set, may have no columns
+    // to select.
+    if (prob->l == 0) {
+      prob->P[0] = 0;
+      prob->X = new ffm_node[0];
+      return 0;
+    }
 
-      feature_col_idxs.push_back(get_column_index(tr->sf, col));
+    gl_sarray target = prob->sf.select_column(prob->target_column);
+    if (!decode_labels(target, 0, prob->l, prob->Y)) {
+      logprogress_stream << "Column " << target_col_idx << std::endl;
+      logprogress_stream << flex_type_enum_to_name(target.dtype()) << std::endl;
+      ffm_destroy_problem(prob);
+      log_and_throw("Response must be integer type.");
     }
 
-    
-    for(ffm_int iter = 0; iter < param.nr_iters; iter++)
+    // First pass: the row offsets, from the dict lengths alone.
+    fill(prob->P, prob->P+prob->l+1, 0);
+    for (auto const &col : feature_cols) {
+      if (!count_dict_column(col, 0, prob->l, prob->P+1)) {
+        ffm_destroy_problem(prob);
+        log_and_throw("Feature columns currently must be dict.");
+      }
+    }
+    for (ffm_int i = 0; i < prob->l; i++)
+      prob->P[i+1] += prob->P[i];
+    ffm_long nnz = prob->P[prob->l];
+
+    // X is sized up front, either in memory or as a spill file mapped 
+    // writable; the kernel writes the latter back as it fills up.
+    int fd = -1;
+    if (spill_path != nullptr)
     {
-      ffm_double tr_loss = 0;
-
-      size_t i = 0;
-      std::vector<ffm_node> row_nodes; 
-      auto rsf = tr->sf.range_iterator();
-      auto it = rsf.begin();
-
-      for (; it != rsf.end(); ++it, ++i) { 
+        fd = open(spill_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        void *ptr = MAP_FAILED;
+        if (fd >= 0 && nnz > 0 &&
+            ftruncate(fd, nnz*sizeof(ffm_node)) == 0)
+            ptr = mmap(nullptr, nnz*sizeof(ffm_node), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        if (fd < 0 || (nnz > 0 && ptr == MAP_FAILED))
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+                unlink(spill_path);
+            }
+            ffm_destroy_problem(prob);
+            return 1;
+        }
+        if (nnz > 0)
+        {
+            prob->X = (ffm_node*)ptr;
+            prob->X_mmapped = true;
+        }
+    }
+    if (prob->X == nullptr)
+        prob->X = new ffm_node[nnz];
 
-        row_nodes.clear();
-        std::vector<flexible_type> row = *it;
-        const auto& yval = row[target_col_idx];
+    // Second pass: the nodes, one block of rows and one column at a time.
+    vector<ffm_long> cursor;
+    vector<ffm_float> norm;
+    for (size_t begin = 0; begin < (size_t)prob->l; begin += kDecodeBlock)
+    {
+        size_t end = min(begin+kDecodeBlock, (size_t)prob->l);
+        cursor.assign(prob->P+begin, prob->P+end);
+        norm.assign(end-begin, 0);
+        for (size_t c = 0; c < feature_cols.size(); c++)
+            decode_dict_column(feature_cols[c], feature_col_idxs[c], 
+                               begin, end, prob->X, cursor.data(), 
+                               norm.data());
+        for (size_t i = begin; i < end; i++)
+            prob->R[i] = norm_scale(norm[i-begin]);
+    }
 
-        if (row[target_col_idx].get_type() != flex_type_enum::INTEGER) {
-          log_and_throw("Response must be integer type.");
-        }
+    if (fd < 0)
+        return 0;
 
-        if (row[target_col_idx].get_type() != flex_type_enum::INTEGER) {
-          logprogress_stream << "Column " << target_col_idx << std::endl;
-          logprogress_stream << flex_type_enum_to_name(row[target_col_idx].get_type()) << std::endl;
-          log_and_throw("Response must be integer type.");
-        }
-        ffm_float y = (yval.get<flex_int>() > 0) ? 1.0f : -1.0f;
+    // The mapping keeps the data alive, so the file can be unlinked right
+    // away and the kernel pages it in and out as the epochs sweep over it.
+    if (prob->X_mmapped)
+    {
+        mprotect(prob->X, nnz*sizeof(ffm_node), PROT_READ);
+        madvise(prob->X, nnz*sizeof(ffm_node), MADV_SEQUENTIAL);
+    }
+    close(fd);
+    unlink(spill_path);
 
-        for (size_t col : feature_col_idxs) {
-          if (row[col] != FLEX_UNDEFINED) {
-            if (row[col].get_type() != flex_type_enum::DICT) {
-              log_and_throw("Feature columns currently must be dict.");
-            }
-            const flex_dict& dv = row[col].get<flex_dict>(); 
-            size_t n_values = dv.size(); 
-            for(size_t k = 0; k < n_values; ++k) { 
-              const std::pair<flexible_type, flexible_type>& kvp = dv[k];
+    return 0;
+}
 
-              ffm_node fv;
-              fv.f = col; 
-              fv.j = kvp.first.get<flex_int>(); 
-              fv.v = (float) kvp.second;
+ffm_int ffm_read_arrays(
+    int32_t const *field,
+    int32_t const *index,
+    float const *value,
+    int64_t const *indptr,
+    float const *label,
+    ffm_int l,
+    ffm_int nr_threads,
+    ffm_problem *prob)
+{
+    prob->l = 0;
+    prob->n = 0;
+    prob->m = 0;
+    prob->X = nullptr;
+    prob->P = nullptr;
+    prob->Y = nullptr;
+    prob->R = nullptr;
+    prob->X_mmapped = false;
+
+    if(l < 0)
+        return 1;
+    for(ffm_int i = 0; i < l; i++)
+        if(indptr[i+1] < indptr[i])
+            return 1;
+
+    // indptr may come from a slice of a larger array, so it need not 
+    // start at zero.
+    ffm_long base = indptr[0];
+    ffm_long nnz = indptr[l]-base;
+
+    prob->l = l;
+    prob->X = new ffm_node[nnz];
+    prob->P = new ffm_long[l+1];
+    prob->Y = new ffm_float[l];
+    prob->R = new ffm_float[l];
+
+    // One pass over the rows, which interleaves the three node arrays into
+    // the ffm_node layout the kernels read and fills everything else in.
+    ffm_int n = 0, m = 0;
+    bool ok = true;
+#if defined USEOMP
+#pragma omp parallel for schedule(static) num_threads(max(1, nr_threads)) \
+    reduction(max: n, m) reduction(&&: ok)
+#endif
+    for(ffm_int i = 0; i < l; i++)
+    {
+        prob->P[i+1] = indptr[i+1]-base;
+        prob->Y[i] = label != nullptr && label[i] > 0 ? 1.0f : -1.0f;
 
-              row_nodes.push_back(fv);
-            }
-          }
+        ffm_float norm = 0;
+        for(ffm_long p = indptr[i]; p < indptr[i+1]; p++)
+        {
+            ffm_node &N = prob->X[p-base];
+            N.f = field[p];
+            N.j = index[p];
+            N.v = value[p];
+            ok = ok && N.f >= 0 && N.j >= 0;
+            m = max(m, N.f+1);
+            n = max(n, N.j+1);
+            norm += N.v*N.v;
         }
+        prob->R[i] = norm_scale(norm);
+    }
+    prob->P[0] = 0;
 
-        ffm_node blank;
-        row_nodes.push_back(blank);
+    if(!ok)
+    {
+        ffm_destroy_problem(prob);
+        return 1;
+    }
+    prob->n = n;
+    prob->m = m;
 
-        ffm_node *begin = row_nodes.data(); 
+    return 0;
+}
 
-        ffm_node *end = &row_nodes.back();
+ffm_int ffm_read_array_files(
+    char const *prefix, 
+    bool labeled, 
+    ffm_int nr_threads, 
+    ffm_problem *prob)
+{
+    char const *names[] = {".field", ".index", ".value", ".indptr", ".label"};
+    size_t const sizes[] = {sizeof(int32_t), sizeof(int32_t), sizeof(float),
+                            sizeof(int64_t), sizeof(float)};
+    ffm_int nr_files = labeled ? 5 : 4;
+
+    char const *data[5] = {nullptr};
+    size_t size[5] = {0};
+    bool ok = true;
+    for(ffm_int i = 0; ok && i < nr_files; i++)
+        ok = map_file((string(prefix)+names[i]).c_str(), data[i], size[i]) &&
+             size[i] % sizes[i] == 0;
+
+    // The files must agree on the number of nodes and rows, and indptr must
+    // stay within the nodes, before any of them is read as arrays.
+    ffm_long nnz = size[0]/sizeof(int32_t);
+    ffm_long nr_ptrs = size[3]/sizeof(int64_t);
+    int64_t const *indptr = (int64_t const*)data[3];
+    ok = ok && 
+         size[1]/sizeof(int32_t) == (size_t)nnz && 
+         size[2]/sizeof(float) == (size_t)nnz &&
+         nr_ptrs >= 1 && nr_ptrs-1 <= INT32_MAX &&
+         (!labeled || size[4]/sizeof(float) == (size_t)nr_ptrs-1) &&
+         indptr[0] >= 0 && indptr[nr_ptrs-1] <= nnz;
+
+    ffm_int status = ok ? 
+        ffm_read_arrays((int32_t const*)data[0], (int32_t const*)data[1], 
+                        (float const*)data[2], indptr, 
+                        labeled ? (float const*)data[4] : nullptr, 
+                        (ffm_int)(nr_ptrs-1), nr_threads, prob) : 1;
+
+    for(ffm_int i = 0; i < nr_files; i++)
+        if(data[i] != nullptr)
+            munmap((void*)data[i], size[i]);
+
+    return status;
+}
 
-        ffm_float r = 1.0;
+void ffm_decode_sframe(
+    graphlab::gl_sframe const &sf,
+    std::string const &target_column,
+    std::vector<std::string> const &feature_columns,
+    size_t begin,
+    size_t end,
+    std::vector<ffm_node> &X,
+    std::vector<ffm_long> &P,
+    std::vector<ffm_float> &Y)
+{
+    end = min(end, sf.size());
+    size_t l = end > begin ? end-begin : 0;
+
+    if (l == 0) {
+      X.clear();
+      P.assign(1, 0);
+      Y.clear();
+      return;
+    }
 
-        ffm_float t = wTx(begin, end, r, *model);
-        // logprogress_stream << " y " << y 
-        //                   << " #nodes " << row_nodes.size() 
-        //                   <<" i " << i
-        //                    << " pred " << t 
-        //                   << std::endl;
+    Y.resize(l);
+    if (!decode_labels(sf.select_column(target_column), begin, end, Y.data()))
+      log_and_throw("Response must be integer type.");
 
-        ffm_float expnyt = exp(-y*t);
+    std::vector<size_t> feature_col_idxs;
+    std::vector<gl_sarray> feature_cols;
+    for (auto const &col : feature_columns) {
+      feature_col_idxs.push_back(get_column_index(sf, col));
+      feature_cols.push_back(sf.select_column(col));
+    }
 
-        tr_loss += log(1+expnyt);
+    P.assign(l+1, 0);
+    for (auto const &col : feature_cols) {
+      if (!count_dict_column(col, begin, end, P.data()+1))
+        log_and_throw("Feature columns currently must be dict.");
+    }
+    for (size_t i = 0; i < l; i++)
+      P[i+1] += P[i];
+
+    X.resize(P[l]);
+    vector<ffm_long> cursor(P.begin(), P.end()-1);
+    for (size_t c = 0; c < feature_cols.size(); c++)
+        decode_dict_column(feature_cols[c], feature_col_idxs[c], begin, end,
+                           X.data(), cursor.data(), nullptr);
+}
 
-        ffm_float kappa = -y*expnyt/(1+expnyt);
+void ffm_destroy_problem(ffm_problem *prob)
+{
+    if(prob->X_mmapped)
+        munmap(prob->X, prob->P[prob->l]*sizeof(ffm_node));
+    else
+        delete[] prob->X;
+    delete[] prob->P;
+    delete[] prob->Y;
+    delete[] prob->R;
+    prob->X = nullptr;
+    prob->P = nullptr;
+    prob->Y = nullptr;
+    prob->R = nullptr;
+    prob->X_mmapped = false;
+}
 
-        wTx(begin, end, r, *model, kappa, param.eta, param.lambda, true);
+ffm_int ffm_write_model(
+    ffm_model *model, 
+    function<bool(void const*, size_t)> const &write)
+{
+    ffm_long align1 = (ffm_long)model->m*model->k;
+
+    // A sparse model is written as the features it has rows for, unless 
+    // that turns out to be all of them.
+    vector<int32_t> ids;
+    if(model->rows != nullptr)
+        for(ffm_int j = 0; j < model->n; j++)
+            if(model->rows[j] != nullptr)
+                ids.push_back(j);
+    bool sparse = model->rows != nullptr && (ffm_int)ids.size() < model->n;
+    ffm_long nr_rows = sparse ? (ffm_long)ids.size() : model->n;
+
+    ffm_long offset = kMODEL_HEADER_SIZE;
+    if(sparse)
+        offset = align_up(offset + ids.size()*sizeof(int32_t), kALIGNByte);
+
+    model_checksum checksum;
+    for(ffm_long i = 0; i < nr_rows; i++)
+        checksum.add(model_row(*model, sparse ? ids[i] : i, align1), align1);
+
+    model_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMODEL_MAGIC, sizeof(header.magic));
+    header.version = kMODEL_VERSION;
+    header.n = model->n;
+    header.m = model->m;
+    header.k = model->k;
+    header.normalization = model->normalization;
+    header.align = kALIGNByte;
+    header.offset = offset;
+    header.size = nr_rows*align1*sizeof(ffm_float);
+    header.checksum = checksum.value();
+    header.nr_rows = sparse ? nr_rows : 0;
+
+    vector<char> head(offset, 0);
+    memcpy(head.data(), &header, sizeof(header));
+    if(sparse)
+        memcpy(head.data()+kMODEL_HEADER_SIZE, ids.data(), 
+               ids.size()*sizeof(int32_t));
+
+    if(!write(head.data(), head.size()))
+        return 1;
 
-      }
+    if(model->rows == nullptr)
+        return write(model->W, header.size) ? 0 : 1;
 
-      if(!param.quiet)
-      {
-        tr_loss /= tr->l;
+    // Rows are scattered over the slabs, so they are gathered into batches
+    // of about kBatchFloats to keep the number of writes small.
+    ffm_long const kBatchFloats = 1 << 20;
+    ffm_long batch_rows = max(kBatchFloats/max(align1, 1LL), 1LL);
+    vector<ffm_float> batch(min(batch_rows, nr_rows)*align1);
+    for(ffm_long i = 0; i < nr_rows; i += batch_rows)
+    {
+        ffm_long i_end = min(i+batch_rows, nr_rows);
+        for(ffm_long ii = i; ii < i_end; ii++)
+            memcpy(batch.data()+(ii-i)*align1, 
+                   model->rows[sparse ? ids[ii] : ii], 
+                   align1*sizeof(ffm_float));
+        if(!write(batch.data(), (i_end-i)*align1*sizeof(ffm_float)))
+            return 1;
+    }
 
-        stringstream ss;
-        ss << setw(4) << iter 
-           << setw(13) << fixed 
-           << setprecision(5) << tr_loss;
-        if(va != nullptr && va->l != 0)
-        {
-          ffm_double va_loss = 0;
-
-          size_t i = 0;
-          std::vector<ffm_node> row_nodes; 
-          auto r = va->sf.range_iterator();
-          auto it = r.begin();
-
-          for (; it != r.end(); ++it, ++i) { 
-
-            row_nodes.clear();
-            const std::vector<flexible_type>& row = *it;
-            const auto& yval = row[target_col_idx];
-            ffm_float y = (yval.get<flex_int>() > 0) ? 1.0f : -1.0f;
-
-            for (size_t col : feature_col_idxs) {
-              if (row[col] != FLEX_UNDEFINED) {
-                if (row[col].get_type() != flex_type_enum::DICT) {
-                  log_and_throw("Feature columns must be dict type.");
-                }
-                const flex_dict& dv = row[col].get<flex_dict>(); 
-                size_t n_values = dv.size(); 
-                for(size_t k = 0; k < n_values; ++k) { 
-                  const std::pair<flexible_type, flexible_type>& kvp = dv[k];
-
-                  ffm_node fv;
-                  fv.f = col; 
-                  fv.j = kvp.first.get<flex_int>(); 
-                  fv.v = (float) kvp.second;
-
-                  row_nodes.push_back(fv);
-                }
-              }
-            }
+    return 0;
+}
 
-            ffm_node blank;
-            row_nodes.push_back(blank);
+ffm_model* ffm_read_model(function<bool(void*, size_t)> const &read)
+{
+    char head[kMODEL_HEADER_SIZE];
+    if(!read(head, sizeof(head)))
+        return nullptr;
 
-            ffm_node *begin = row_nodes.data(); 
+    // The header says how much follows, so it is checked in full before 
+    // anything is mapped for the rest.
+    model_header const *header = (model_header const*)head;
+    if(memcmp(header->magic, kMODEL_MAGIC, sizeof(header->magic)) != 0 ||
+       header->size > UINT64_MAX-header->offset ||
+       !valid_model_header(*header, header->offset + header->size))
+        return nullptr;
+    size_t size = header->offset + header->size;
 
-            ffm_node *end = &row_nodes.back();
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, 
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED)
+        return nullptr;
 
-            ffm_float r = 1.0; 
+    memcpy(ptr, head, sizeof(head));
+    if(!read((char*)ptr+sizeof(head), size-sizeof(head)))
+    {
+        munmap(ptr, size);
+        return nullptr;
+    }
 
-            ffm_float t = wTx(begin, end, r, *model);
+    ffm_model *model = model_from_mapping(ptr, size);
+    if(model == nullptr)
+        return nullptr;
 
-            ffm_float expnyt = exp(-y*t);
+    // Every byte has just been copied in anyway, so unlike a mapped file 
+    // the weights are checked against the header's checksum.
+    header = (model_header const*)ptr;
+    model_checksum checksum;
+    checksum.add((ffm_float const*)((char const*)ptr + header->offset), 
+                 header->size/sizeof(ffm_float));
+    if(checksum.value() != header->checksum)
+        ffm_destroy_model(&model);
 
-            va_loss += log(1+expnyt);
-          }
-          va_loss /= va->l;
+    return model;
+}
 
-          ss << setw(13) << fixed << setprecision(5) << va_loss;
+ffm_int ffm_save_model(ffm_model *model, char const *path)
+{
+    FILE *f_out = fopen(path, "wb");
+    if(f_out == nullptr)
+        return 1;
 
-        }
-        ss << endl;
-        logprogress_stream << ss.str() << endl;
-      }
-    }
+    ffm_int status = ffm_write_model(model, 
+        [f_out](void const *data, size_t size)
+        {
+            return size == 0 || fwrite(data, size, 1, f_out) == 1;
+        });
 
-    shrink_model(*model, param.k);
+    if(fclose(f_out) != 0 || status != 0)
+        return 1;
 
-    return model;
+    return 0;
 }
 
-} // unnamed namespace
-
-ffm_int ffm_save_model(ffm_model *model, char const *path)
+ffm_int ffm_save_model_txt(ffm_model *model, char const *path)
 {
     ofstream f_out(path);
     if(!f_out.is_open())
@@ -412,14 +2535,17 @@ ffm_int ffm_save_model(ffm_model *model, char const *path)
     f_out << "k " << model->k << "\n";
     f_out << "normalization " << model->normalization << "\n";
 
-    ffm_float *ptr = model->W;
+    // Features a sparse model never saw are written as zeros, which 
+    // predict the same as having no row at all.
+    ffm_long align1 = (ffm_long)model->m*model->k;
     for(ffm_int j = 0; j < model->n; j++)
     {
+        ffm_float *ptr = model_row(*model, j, align1);
         for(ffm_int f = 0; f < model->m; f++)
         {
             f_out << "w" << j << "," << f << " ";
-            for(ffm_int d = 0; d < model->k; d++, ptr++)
-                f_out << *ptr << " ";
+            for(ffm_int d = 0; d < model->k; d++)
+                f_out << (ptr != nullptr ? *ptr++ : 0) << " ";
             f_out << "\n";
         }
     }
@@ -433,10 +2559,25 @@ ffm_model* ffm_load_model(char const *path)
     if(!f_in.is_open())
         return nullptr;
 
+    char magic[sizeof(kMODEL_MAGIC)] = {0};
+    f_in.read(magic, sizeof(magic));
+    if(f_in.gcount() == sizeof(magic) && 
+       memcmp(magic, kMODEL_MAGIC, sizeof(magic)) == 0)
+    {
+        f_in.close();
+        return load_model_bin(path);
+    }
+    f_in.clear();
+    f_in.seekg(0);
+
     string dummy;
 
     ffm_model *model = new ffm_model;
     model->W = nullptr;
+    model->mapped = nullptr;
+    model->mapped_size = 0;
+    model->rows = nullptr;
+    model->pages = nullptr;
 
     f_in >> dummy >> model->n >> dummy >> model->m >> dummy >> model->k 
          >> dummy >> model->normalization;
@@ -469,7 +2610,12 @@ void ffm_destroy_model(ffm_model **model)
 {
     if(model == nullptr || *model == nullptr)
         return;
-    free((*model)->W);
+    if((*model)->mapped != nullptr)
+        munmap((*model)->mapped, (*model)->mapped_size);
+    else
+        free((*model)->W);
+    free((*model)->rows);
+    delete (model_pages*)(*model)->pages;
     delete *model;
     *model = nullptr;
 }
@@ -486,29 +2632,61 @@ ffm_parameter ffm_get_default_param()
     param.quiet = false;
     param.normalization = false;
     param.random = true;
+    param.sparse = false;
+    param.loss_interval = 1;
+    param.auto_stop = false;
+    param.patience = 1;
+    param.batch_size = 1;
+    param.checkpoint_path = nullptr;
+    param.checkpoint_interval = 1;
+    param.resume_path = nullptr;
 
     return param;
 }
 
 ffm_model* train_with_validation(ffm_problem *tr, ffm_problem *va, ffm_parameter param)
 {
+    if(tr->X == nullptr && ffm_materialize_problem(tr, nullptr) != 0)
+        return nullptr;
+    if(va != nullptr && va->X == nullptr && 
+       ffm_materialize_problem(va, nullptr) != 0)
+        return nullptr;
+
     vector<ffm_int> order(tr->l);
     for(ffm_int i = 0; i < tr->l; i++)
         order[i] = i;
 
     shared_ptr<ffm_model> model = train(tr, order, param, va);
+    if(!model)
+        return nullptr;
 
-    ffm_model *model_ret = new ffm_model;
+    return release_model(*model);
+}
 
-    model_ret->n = model->n;
-    model_ret->m = model->m;
-    model_ret->k = model->k;
-    model_ret->normalization = model->normalization;
+ffm_model* ffm_train_incremental(
+    ffm_model const *init, 
+    ffm_problem *tr, 
+    ffm_problem *va, 
+    ffm_parameter param)
+{
+    if(init == nullptr && param.resume_path == nullptr)
+        return nullptr;
 
-    model_ret->W = model->W;
-    model->W = nullptr;
+    if(tr->X == nullptr && ffm_materialize_problem(tr, nullptr) != 0)
+        return nullptr;
+    if(va != nullptr && va->X == nullptr && 
+       ffm_materialize_problem(va, nullptr) != 0)
+        return nullptr;
 
-    return model_ret;
+    vector<ffm_int> order(tr->l);
+    for(ffm_int i = 0; i < tr->l; i++)
+        order[i] = i;
+
+    shared_ptr<ffm_model> model = train(tr, order, param, va, true, init);
+    if(!model)
+        return nullptr;
+
+    return release_model(*model);
 }
 
 ffm_model* ffm_train(ffm_problem *prob, ffm_parameter param)
@@ -516,17 +2694,267 @@ ffm_model* ffm_train(ffm_problem *prob, ffm_parameter param)
     return train_with_validation(prob, nullptr, param);
 }
 
-ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model)
+ffm_model* ffm_train_on_shards(
+    char const * const *paths, 
+    ffm_int nr_paths, 
+    ffm_problem *va, 
+    ffm_parameter param)
+{
+    if(va != nullptr && va->X == nullptr && 
+       ffm_materialize_problem(va, nullptr) != 0)
+        return nullptr;
+    fill_row_scales(va);
+
+    // Only the headers are read up front, for the model dimensions.
+    vector<string> shard_paths;
+    ffm_int n = 0, m = 0;
+    ffm_long l = 0;
+    for(ffm_int i = 0; i < nr_paths; i++)
+    {
+        FILE *f = fopen(paths[i], "rb");
+        shard_header header;
+        bool ok = f != nullptr && read_shard_header(f, header);
+        if(f != nullptr)
+            fclose(f);
+        if(!ok)
+            return nullptr;
+        n = max(n, header.n);
+        m = max(m, header.m);
+        l += header.l;
+        shard_paths.push_back(paths[i]);
+    }
+
+#if defined USEOMP
+    ffm_int old_nr_threads = omp_get_max_threads();
+    omp_set_num_threads(param.nr_threads);
+#endif
+
+    shared_ptr<ffm_model> model = create_model(n, m, param);
+
+    ffm_wTx wTx = ffm_kernel_wTx(kernel(), model->k);
+
+    if(!param.quiet)
+        log_header(va);
+
+    mt19937 rng;
+
+    timer tr_timer;
+    ffm_double tr_time = 0;
+
+    // Double buffering: while the SGD pass runs over one chunk, a 
+    // background read fills the other, so training only waits on the disk
+    // when it is slower than the arithmetic.
+    shard_stream stream;
+    shard_chunk chunks[2];
+    vector<ffm_int> base_order, order;
+
+    bool has_va = va != nullptr && va->l != 0;
+    bool auto_stop = param.auto_stop && has_va;
+    early_stop stop;
+
+    ffm_int nr_epochs = 0;
+    for(ffm_int iter = 0; iter < param.nr_iters; iter++)
+    {
+        nr_epochs = iter+1;
+
+        ffm_double tr_loss = 0;
+
+        // Chunks are read sequentially for throughput, so randomization 
+        // is limited to the shard order and the rows within each chunk.
+        if(param.random)
+            shuffle(shard_paths.begin(), shard_paths.end(), rng);
+        stream.reset(shard_paths);
+
+        tr_timer.start();
+
+        ffm_int cur = 0;
+        future<bool> pending = async(launch::async, 
+            [&stream, &chunks] () { return stream.read(chunks[0]); });
+        while(pending.get())
+        {
+            shard_chunk &chunk = chunks[cur];
+            shard_chunk &next = chunks[1-cur];
+            pending = async(launch::async, 
+                [&stream, &next] () { return stream.read(next); });
+
+            base_order.resize(chunk.l);
+            for(ffm_int i = 0; i < chunk.l; i++)
+                base_order[i] = i;
+            if(param.random)
+                block_shuffle(base_order, 
+                              shuffle_block_size(chunk.P.data(), chunk.l), 
+                              order, rng);
+            else
+                order = base_order;
+
+            touch_rows(*model, chunk.X.data(), chunk.P.data(), order, 
+                       param);
+
+            tr_loss += sgd_pass(chunk.X.data(), chunk.P.data(), 
+                                chunk.Y.data(), 
+                                param.normalization ? chunk.R.data() : nullptr,
+                                order, *model, wTx, param);
+
+            cur = 1-cur;
+        }
+
+        tr_time += tr_timer.current_time();
+
+        ffm_double va_loss = 0;
+        if(has_va && (auto_stop || !param.quiet))
+            va_loss = va_logloss(va, *model, wTx);
+
+        if(!param.quiet)
+            log_iter(iter, tr_loss/max(l, (ffm_long)1), va, va_loss);
+
+        if(auto_stop && stop.update(iter, va_loss, *model, param))
+            break;
+    }
+
+    if(auto_stop)
+        stop.finish(*model, param);
+
+    if(!param.quiet)
+    {
+        log_throughput((ffm_double)l*nr_epochs, tr_time, 
+                       param.nr_threads);
+        log_pages(*model);
+    }
+
+#if defined USEOMP
+    omp_set_num_threads(old_nr_threads);
+#endif
+
+    shrink_model(*model, param.k);
+
+    return release_model(*model);
+}
+
+ffm_float ffm_cross_validation(
+    ffm_problem *prob, 
+    ffm_int nr_folds,
+    ffm_parameter param)
 {
-    ffm_float r = 1;
-    if(model->normalization)
+    // Every fold needs at least one row to evaluate on, or it would add a
+    // loss of 0 to the mean.
+    if(nr_folds < 2 || nr_folds > prob->l)
+        return -1;
+
+    if(prob->X == nullptr && ffm_materialize_problem(prob, nullptr) != 0)
+        return -1;
+
+    // Before the folds start, as they all read prob.
+    fill_row_scales(prob);
+
+    bool quiet = param.quiet;
+    param.quiet = true;
+
+    // Folds train concurrently, so they cannot share a checkpoint file.
+    param.checkpoint_path = nullptr;
+    param.resume_path = nullptr;
+
+    // Folds are views of the one decoded problem: each trains on a list 
+    // of row indices and evaluates on the rows its list leaves out.
+    vector<ffm_int> order(prob->l);
+    for(ffm_int i = 0; i < prob->l; i++)
+        order[i] = i;
+    mt19937 rng;
+    shuffle(order.begin(), order.end(), rng);
+
+    // Spread the threads over concurrent folds first, then within each 
+    // fold's Hogwild epochs.
+    ffm_int nr_parallel_folds = max(1, min(nr_folds, param.nr_threads));
+    ffm_int nr_threads = param.nr_threads;
+    param.nr_threads = max(1, nr_threads/nr_parallel_folds);
+
+    ffm_int nr_instance_per_fold = prob->l/nr_folds;
+
+    vector<ffm_double> losses(nr_folds, 0);
+    vector<ffm_double> times(nr_folds, 0);
+
+    timer cv_timer;
+    cv_timer.start();
+
+#if defined USEOMP
+    ffm_int old_max_active_levels = omp_get_max_active_levels();
+    if(param.nr_threads > 1)
+        omp_set_max_active_levels(2);
+#pragma omp parallel for schedule(dynamic) num_threads(nr_parallel_folds)
+#endif
+    for(ffm_int fold = 0; fold < nr_folds; fold++)
+    {
+        timer fold_timer;
+        fold_timer.start();
+
+        ffm_int va_begin = fold*nr_instance_per_fold;
+        ffm_int va_end = fold == nr_folds-1 ? 
+                         prob->l : va_begin + nr_instance_per_fold;
+
+        vector<ffm_int> order1;
+        order1.reserve(prob->l-(va_end-va_begin));
+        for(ffm_int i = 0; i < va_begin; i++)
+            order1.push_back(order[i]);
+        for(ffm_int i = va_end; i < prob->l; i++)
+            order1.push_back(order[i]);
+
+        shared_ptr<ffm_model> model = train(prob, order1, param);
+
+        ffm_double loss = 0;
+        for(ffm_int ii = va_begin; ii < va_end; ii++)
+        {
+            ffm_int i = order[ii];
+
+            ffm_float y = prob->Y[i];
+            
+            ffm_node *begin = &prob->X[prob->P[i]];
+
+            ffm_node *end = &prob->X[prob->P[i+1]];
+
+            ffm_float y_bar = ffm_predict(begin, end, model.get());
+
+            loss -= y==1? log(y_bar) : log(1-y_bar);
+        }
+        if(va_end > va_begin)
+            loss /= va_end-va_begin;
+
+        losses[fold] = loss;
+        times[fold] = fold_timer.current_time();
+    }
+#if defined USEOMP
+    omp_set_max_active_levels(old_max_active_levels);
+#endif
+
+    ffm_double loss = 0;
+    for(ffm_int fold = 0; fold < nr_folds; fold++)
+        loss += losses[fold];
+    loss /= nr_folds;
+
+    if(!quiet)
     {
-        r = 0;
-        for(ffm_node *N = begin; N != end; N++)
-            r += N->v*N->v; 
-        r = 1/sqrt(r);
+        stringstream ss;
+        ss << setw(4) << "fold" << setw(13) << "logloss" 
+           << setw(13) << "time" << endl;
+        for(ffm_int fold = 0; fold < nr_folds; fold++)
+        {
+            ss << setw(4) << fold 
+               << setw(13) << fixed << setprecision(5) << losses[fold]
+               << setw(13) << fixed << setprecision(2) << times[fold] 
+               << endl;
+        }
+        ss << setw(4) << "avg" 
+           << setw(13) << fixed << setprecision(5) << loss
+           << setw(13) << fixed << setprecision(2) 
+           << cv_timer.current_time() << endl;
+        logprogress_stream << ss.str() << endl;
     }
 
+    return loss;
+}
+
+ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model)
+{
+    ffm_float r = model->normalization ? norm_scale(begin, end) : 1;
+
     ffm_long align0 = (ffm_long)model->k;
     ffm_long align1 = (ffm_long)model->m*align0;
 
@@ -536,7 +2964,11 @@ ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model)
         ffm_int j1 = N1->j;
         ffm_int f1 = N1->f;
         ffm_float v1 = N1->v;
-        if(j1 >= model->n || f1 >= model->m)
+        if((uint32_t)j1 >= (uint32_t)model->n || 
+           (uint32_t)f1 >= (uint32_t)model->m)
+            continue;
+        ffm_float *row1 = model_row(*model, j1, align1);
+        if(row1 == nullptr)
             continue;
 
         for(ffm_node *N2 = N1+1; N2 != end; N2++)
@@ -544,11 +2976,15 @@ ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model)
             ffm_int j2 = N2->j;
             ffm_int f2 = N2->f;
             ffm_float v2 = N2->v;
-            if(j2 >= model->n || f2 >= model->m || f1 == f2)
+            if((uint32_t)j2 >= (uint32_t)model->n || 
+               (uint32_t)f2 >= (uint32_t)model->m || f1 == f2)
+                continue;
+            ffm_float *row2 = model_row(*model, j2, align1);
+            if(row2 == nullptr)
                 continue;
 
-            ffm_float *w1 = model->W + j1*align1 + f2*align0;
-            ffm_float *w2 = model->W + j2*align1 + f1*align0;
+            ffm_float *w1 = row1 + f2*align0;
+            ffm_float *w2 = row2 + f1*align0;
 
             ffm_float v = 2*v1*v2*r;
 
@@ -560,4 +2996,44 @@ ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model)
     return 1/(1+exp(-t));
 }
 
+void ffm_predict_batch(
+    ffm_node *X, 
+    ffm_long *P, 
+    ffm_int l, 
+    ffm_model *model, 
+    ffm_float *out,
+    ffm_int nr_threads)
+{
+    // The SIMD kernels need every block on a 16-byte boundary, which a 
+    // trained model only has when k is a multiple of kALIGN. Sparse rows 
+    // always start on one.
+    ffm_wTx predict = nullptr;
+    if(model->k % kALIGN == 0 && 
+       (model->rows != nullptr || (uintptr_t)model->W % 16 == 0))
+        predict = ffm_kernel_predict(kernel(), model->k);
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static) num_threads(max(1, nr_threads))
+#endif
+    for(ffm_int i = 0; i < l; i++)
+    {
+        ffm_node *begin = &X[P[i]];
+
+        ffm_node *end = &X[P[i+1]];
+
+        if(predict == nullptr)
+        {
+            out[i] = ffm_predict(begin, end, model);
+            continue;
+        }
+
+        ffm_float r = model->normalization ? norm_scale(begin, end) : 1;
+
+        out[i] = predict(begin, end, r, *model, 0, 0, 0, false);
+    }
+
+    if(predict != nullptr)
+        logistic(out, l);
+}
+
 } // namespace ffm
@@ -1,9 +1,14 @@
 #ifndef _LIBFFM_H
 #define _LIBFFM_H
 
+#include <cstdint>
+#include <functional>
+
 #include <graphlab/sdk/gl_sarray.hpp>
 #include <graphlab/sdk/gl_sframe.hpp>
 
+#include "ffm_base.h"
+
 #ifdef __cplusplus
 extern "C" 
 {
@@ -12,43 +17,104 @@ namespace ffm
 {
 #endif
 
-typedef float ffm_float;
-typedef double ffm_double;
-typedef int ffm_int;
-typedef long long ffm_long;
-
 size_t get_column_index(graphlab::gl_sframe sf, std::string colname);
 
 typedef graphlab::gl_sarray blah;
 
-struct ffm_node
-{
-    ffm_int f;
-    ffm_int j;
-    ffm_float v;
-};
-
 struct ffm_problem
 {
     ffm_int n;
     ffm_int l;
     ffm_int m;
+    ffm_node *X;
+    ffm_long *P;
+    ffm_float *Y;
+    // 1/||x|| of each row, computed with X for instance-wise normalization.
+    ffm_float *R;
+    bool X_mmapped;
     graphlab::gl_sframe sf;
     std::string target_column;
     std::vector<std::string> feature_columns;
 };
 
-struct ffm_model
-{
-    ffm_int n;
-    ffm_int m;
-    ffm_int k;
-    ffm_float *W;
-    bool normalization;
-};
-
+// Decode prob->sf once into the X/P/Y layout (nodes, row offsets, labels)
+// used by every epoch. If spill_path is given, the node array is written
+// there and mapped back read-only instead of being held in memory.
+ffm_int ffm_materialize_problem(ffm_problem *prob, char const *spill_path);
+
+// Builds a problem from CSR arrays such as NumPy ones: row i has the 
+// nodes field/index/value[indptr[i]..indptr[i+1]) and is positive if 
+// label[i] > 0; label may be nullptr for rows that are only scored. The 
+// arrays are only read, in one parallel pass that lays the nodes out for 
+// the kernels. Returns 0 on success and 1 if indptr is not ascending or a
+// field or index is negative.
+ffm_int ffm_read_arrays(
+    int32_t const *field,
+    int32_t const *index,
+    float const *value,
+    int64_t const *indptr,
+    float const *label,
+    ffm_int l,
+    ffm_int nr_threads,
+    ffm_problem *prob);
+
+// The same from arrays in files, e.g. written by NumPy's tofile(): raw 
+// int32 <prefix>.field and <prefix>.index, float32 <prefix>.value, int64 
+// <prefix>.indptr and, if labeled, float32 <prefix>.label. The files are 
+// mapped and read in place. Returns 0 on success and 1 if a file cannot 
+// be mapped, their sizes do not agree or ffm_read_arrays() fails.
+ffm_int ffm_read_array_files(
+    char const *prefix, 
+    bool labeled, 
+    ffm_int nr_threads, 
+    ffm_problem *prob);
+
+// Decodes rows [begin, end) of sf into the same X/P/Y layout, one column
+// at a time like ffm_materialize_problem(); X and P are rebuilt from 
+// scratch, with P starting at 0.
+void ffm_decode_sframe(
+    graphlab::gl_sframe const &sf,
+    std::string const &target_column,
+    std::vector<std::string> const &feature_columns,
+    size_t begin,
+    size_t end,
+    std::vector<ffm_node> &X,
+    std::vector<ffm_long> &P,
+    std::vector<ffm_float> &Y);
+
+void ffm_destroy_problem(ffm_problem *prob);
+
+// Reads a libffm text file in one pass: the file is mapped, split into 
+// line-aligned ranges parsed on up to nr_threads threads, and the pieces 
+// are merged into prob's X/P/Y. Returns 0 on success and 1 on failure, 
+// which includes a node with a negative field or index.
+ffm_int ffm_read_problem(char const *path, ffm_int nr_threads, ffm_problem *prob);
+
+// Writes the versioned binary format: a fixed header (n, m, k, 
+// normalization, alignment, checksum) followed by the raw W block.
 ffm_int ffm_save_model(ffm_model *model, char const *path);
 
+// The same binary format through a caller-supplied sink, e.g. a 
+// serialization archive: write(data, size) is called with the header and 
+// then with the weights, which go in as one block for a dense model and in
+// large batches of rows for a sparse one. write returns false on failure.
+ffm_int ffm_write_model(
+    ffm_model *model, 
+    std::function<bool(void const*, size_t)> const &write);
+
+// Reads what ffm_write_model() wrote back through read(data, size) into an
+// anonymous mapping laid out like a mapped model file, so the weights are 
+// copied once and nothing is parsed. Returns nullptr if read fails, the 
+// header is not a valid binary model or the weights do not match its 
+// checksum.
+ffm_model* ffm_read_model(std::function<bool(void*, size_t)> const &read);
+
+// Writes the original text format, one "w<j>,<f>" line per block.
+ffm_int ffm_save_model_txt(ffm_model *model, char const *path);
+
+// Accepts either format. Binary models are mapped rather than read, so 
+// loading costs the same regardless of the model size; for the same reason
+// their checksum is not verified.
 ffm_model* ffm_load_model(char const *path);
 
 void ffm_destroy_model(struct ffm_model **model);
@@ -63,6 +129,14 @@ struct ffm_parameter
     bool quiet;
     bool normalization;
     bool random;
+    bool sparse;
+    ffm_int loss_interval;
+    bool auto_stop;
+    ffm_int patience;
+    ffm_int batch_size;
+    char const *checkpoint_path;
+    ffm_int checkpoint_interval;
+    char const *resume_path;
 };
 
 ffm_parameter ffm_get_default_param();
@@ -75,6 +149,65 @@ ffm_model* train_with_validation(
     struct ffm_problem *Va, 
     struct ffm_parameter param);
 
+// Whether path holds a checkpoint written through param.checkpoint_path.
+bool ffm_is_checkpoint(char const *path);
+
+// Continues training on new data from init, a trained or loaded model, 
+// instead of from random weights. Features and fields that init does not 
+// have are added. Its AdaGrad accumulators are not kept with a trained 
+// model, so they start over; to keep them, pass a nullptr init and set 
+// param.resume_path to a checkpoint instead. Either way training runs 
+// param.nr_iters epochs. Returns nullptr if init or the checkpoint does 
+// not match param, including its normalization setting.
+ffm_model* ffm_train_incremental(
+    ffm_model const *init, 
+    struct ffm_problem *Tr, 
+    struct ffm_problem *Va, 
+    struct ffm_parameter param);
+
+// Chunked binary problem files ("shards"): a header followed by 
+// self-contained chunks of rows (labels, row offsets, nodes), written once
+// by a converter and then streamed by ffm_train_on_shards() without ever 
+// holding the whole problem in memory.
+struct ffm_shard_writer;
+
+ffm_shard_writer* ffm_open_shard_writer(char const *path);
+
+// Appends rows X[P[0]..P[l]) with labels Y[0..l) as one chunk.
+ffm_int ffm_write_shard_chunk(
+    ffm_shard_writer *writer, 
+    ffm_node *X, 
+    ffm_long *P, 
+    ffm_float *Y, 
+    ffm_int l);
+
+ffm_int ffm_close_shard_writer(ffm_shard_writer **writer);
+
+ffm_int ffm_save_problem(ffm_problem *prob, char const *path);
+
+// Converts a libffm text file into a shard without loading it whole: the
+// file is parsed in windows, each split across nr_threads threads, and 
+// written out in order. Sets *nr_rows, if given, to the rows converted. 
+// Returns 0 on success and 1 on failure, which includes a node with a 
+// negative field or index.
+ffm_int ffm_convert_text(
+    char const *text_path, 
+    char const *shard_path, 
+    ffm_int nr_threads,
+    ffm_long *nr_rows);
+
+bool ffm_is_shard(char const *path);
+
+// Trains by streaming the chunks of the given shards every epoch, reading
+// the next chunk in the background while the current one is trained on.
+ffm_model* ffm_train_on_shards(
+    char const * const *paths, 
+    ffm_int nr_paths, 
+    ffm_problem *va, 
+    ffm_parameter param);
+
+// Returns the mean logloss over the folds, or -1 if nr_folds is below 2 
+// or above the number of rows, or prob cannot be decoded.
 ffm_float ffm_cross_validation(
     struct ffm_problem *prob, 
     ffm_int nr_folds,
@@ -82,6 +215,16 @@ ffm_float ffm_cross_validation(
 
 ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model);
 
+// Scores the l rows of the CSR block X/P into out[0..l), using the SIMD 
+// kernels and up to nr_threads threads.
+void ffm_predict_batch(
+    ffm_node *X, 
+    ffm_long *P, 
+    ffm_int l, 
+    ffm_model *model, 
+    ffm_float *out,
+    ffm_int nr_threads);
+
 #ifdef __cplusplus
 } // namespace mf
 
@@ -0,0 +1,54 @@
+#ifndef _LIBFFM_BASE_H
+#define _LIBFFM_BASE_H
+
+// Plain data types shared by ffm.h and the SIMD kernels. The kernels are
+// compiled with wider instruction sets than the rest of the library, so
+// this header must not include the SDK or anything else with inline code.
+
+#ifdef __cplusplus
+extern "C" 
+{
+
+namespace ffm
+{
+#endif
+
+typedef float ffm_float;
+typedef double ffm_double;
+typedef int ffm_int;
+typedef long long ffm_long;
+
+struct ffm_node
+{
+    ffm_int f;
+    ffm_int j;
+    ffm_float v;
+};
+
+struct ffm_model
+{
+    ffm_int n;
+    ffm_int m;
+    ffm_int k;
+    ffm_float *W;
+    bool normalization;
+
+    // Set when W points into a mapped binary model file rather than into
+    // an allocation of its own.
+    void *mapped;
+    ffm_long mapped_size;
+
+    // Sparse store: when set, W is unused and feature j's m blocks live at
+    // rows[j], or nowhere if j has never been seen. pages owns the slabs
+    // the rows are carved from.
+    ffm_float **rows;
+    void *pages;
+};
+
+#ifdef __cplusplus
+} // namespace ffm
+
+} // extern "C"
+#endif
+
+#endif // _LIBFFM_BASE_H
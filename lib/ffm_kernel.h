@@ -0,0 +1,528 @@
+#ifndef _LIBFFM_KERNEL_H
+#define _LIBFFM_KERNEL_H
+
+// Internal interface between ffm.cpp and the SIMD kernels. Each
+// ffm_kernel_<isa>.cpp is built with its own -m flags and instantiates
+// wTx_kernel() below for its vector width; ffm.cpp picks one of them at
+// startup from CPUID, so a single binary runs on any x86-64 host.
+//
+// Everything defined here lives in an unnamed namespace so that the wide
+// instantiations can never be merged into code run on older CPUs.
+
+#include <xmmintrin.h>
+#include <pmmintrin.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "ffm_base.h"
+
+namespace ffm
+{
+
+typedef ffm_float (*ffm_wTx)(
+    ffm_node *begin,
+    ffm_node *end,
+    ffm_float r,
+    ffm_model &model,
+    ffm_float kappa,
+    ffm_float eta,
+    ffm_float lambda,
+    bool do_update);
+
+// Per-thread scratch for mini-batch training: the summed gradients of 
+// the features a batch of rows touches, m blocks of k per feature, found 
+// through an open-addressing table keyed on the feature's row. ffm.cpp 
+// owns the memory and sizes it so that a batch can never fill the table.
+struct ffm_grad_buffer
+{
+    ffm_long mask;          // table size-1, the size a power of two
+    ffm_int *index;         // per table slot: entry number, or -1 if free
+    ffm_float **rows;       // per entry: the model row it belongs to
+    ffm_long *slots;        // per entry: its table slot, for clearing
+    ffm_float *G;           // per entry: m*k summed gradients
+    ffm_int nr_used;
+};
+
+// Adds the gradient of a row with loss derivative kappa to the buffer.
+typedef void (*ffm_grad)(
+    ffm_node *begin,
+    ffm_node *end,
+    ffm_float r,
+    ffm_model &model,
+    ffm_float kappa,
+    ffm_grad_buffer &buf);
+
+// Takes one AdaGrad step on every block in the buffer.
+typedef void (*ffm_apply)(
+    ffm_grad_buffer &buf,
+    ffm_model &model,
+    ffm_float eta,
+    ffm_float lambda);
+
+struct ffm_kernel
+{
+    char const *name;
+
+    // Fully unrolled for the padded k of nearly every model in use, plus 
+    // the generic loop for everything else.
+    ffm_wTx wTx_k4;
+    ffm_wTx wTx_k8;
+    ffm_wTx wTx_k16;
+    ffm_wTx wTx;
+
+    // The same for a trained model, whose blocks hold only the k weights 
+    // and no accumulators. These ignore the update arguments.
+    ffm_wTx predict_k4;
+    ffm_wTx predict_k8;
+    ffm_wTx predict_k16;
+    ffm_wTx predict;
+
+    // Mini-batch training.
+    ffm_grad grad_k4;
+    ffm_grad grad_k8;
+    ffm_grad grad_k16;
+    ffm_grad grad;
+    ffm_apply apply;
+};
+
+inline ffm_wTx ffm_kernel_wTx(ffm_kernel const *kernel, ffm_int k)
+{
+    switch(k)
+    {
+        case 4: return kernel->wTx_k4;
+        case 8: return kernel->wTx_k8;
+        case 16: return kernel->wTx_k16;
+        default: return kernel->wTx;
+    }
+}
+
+// Only valid for k a multiple of 4; other trained models are scored with
+// the scalar ffm_predict().
+inline ffm_wTx ffm_kernel_predict(ffm_kernel const *kernel, ffm_int k)
+{
+    switch(k)
+    {
+        case 4: return kernel->predict_k4;
+        case 8: return kernel->predict_k8;
+        case 16: return kernel->predict_k16;
+        default: return kernel->predict;
+    }
+}
+
+inline ffm_grad ffm_kernel_grad(ffm_kernel const *kernel, ffm_int k)
+{
+    switch(k)
+    {
+        case 4: return kernel->grad_k4;
+        case 8: return kernel->grad_k8;
+        case 16: return kernel->grad_k16;
+        default: return kernel->grad;
+    }
+}
+
+ffm_kernel const *ffm_kernel_sse();
+ffm_kernel const *ffm_kernel_avx2();
+ffm_kernel const *ffm_kernel_avx512();
+
+namespace {
+
+// 128-bit operations. model.k is always padded to a multiple of 4, so this
+// also covers whatever is left over after the wide loop of a kernel.
+struct sse
+{
+    typedef __m128 reg;
+    static ffm_int const width = 4;
+
+    static reg zero() { return _mm_setzero_ps(); }
+    static reg set1(ffm_float x) { return _mm_set1_ps(x); }
+    static reg load(ffm_float const *p) { return _mm_load_ps(p); }
+    static void store(ffm_float *p, reg x) { _mm_store_ps(p, x); }
+    static reg add(reg a, reg b) { return _mm_add_ps(a, b); }
+    static reg sub(reg a, reg b) { return _mm_sub_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm_mul_ps(a, b); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+    static reg rsqrt(reg a) { return _mm_rsqrt_ps(a); }
+
+    static ffm_float hsum(reg x)
+    {
+        x = _mm_hadd_ps(x, x);
+        x = _mm_hadd_ps(x, x);
+        ffm_float t;
+        _mm_store_ss(&t, x);
+        return t;
+    }
+};
+
+// Start of feature j's m blocks, each align0 floats apart. Null for a 
+// feature a sparse model has never seen, whose pairs contribute nothing.
+inline ffm_float *model_row(ffm_model const &model, ffm_int j, ffm_long align1)
+{
+    return model.rows != nullptr ? model.rows[j] : model.W + j*align1;
+}
+
+// A node that survived the pre-pass of wTx_kernel(): where its feature's 
+// row starts, the offset of its own field's block within any row, and 
+// the index one past the run of nodes that share its field.
+struct row_node
+{
+    ffm_float *row;
+    ffm_long offset;
+    ffm_float v;
+    ffm_int f;
+    ffm_int field_end;
+};
+
+// Where a row_node's gradients accumulate. Wrapped rather than kept as a 
+// bare pointer so that its vector, like row_node's, is instantiated inside
+// this namespace instead of as a std::vector<float*> shared with ffm.o.
+struct grad_row
+{
+    ffm_float *G;
+};
+
+// Drops the nodes the model has no weights for and groups the rest by 
+// field, keeping the order within each field. Rows are nearly always 
+// written field by field already, so the insertion sort rarely moves 
+// anything. Returns the number of nodes left in nodes.
+inline ffm_int prepare_row(
+    ffm_node *begin, 
+    ffm_node *end, 
+    ffm_model const &model, 
+    ffm_long align0, 
+    ffm_long align1, 
+    std::vector<row_node> &nodes)
+{
+    nodes.resize(end-begin);
+
+    ffm_int nr_nodes = 0;
+    for(ffm_node *N = begin; N != end; N++)
+    {
+        // Unsigned, so that negative ids from a damaged input are skipped 
+        // along with those the model does not cover.
+        if((uint32_t)N->j >= (uint32_t)model.n || 
+           (uint32_t)N->f >= (uint32_t)model.m)
+            continue;
+        ffm_float *row = model_row(model, N->j, align1);
+        if(row == nullptr)
+            continue;
+
+        row_node node = {row, N->f*align0, N->v, N->f, 0};
+        ffm_int i = nr_nodes++;
+        for(; i > 0 && nodes[i-1].f > node.f; i--)
+            nodes[i] = nodes[i-1];
+        nodes[i] = node;
+    }
+
+    for(ffm_int i = nr_nodes-1; i >= 0; i--)
+        nodes[i].field_end = i+1 < nr_nodes && nodes[i+1].f == nodes[i].f ? 
+                             nodes[i+1].field_end : i+1;
+
+    return nr_nodes;
+}
+
+template<typename V>
+inline void update_step(
+    ffm_float *w1,
+    ffm_float *w2,
+    ffm_float *wg1,
+    ffm_float *wg2,
+    typename V::reg kappav,
+    typename V::reg eta,
+    typename V::reg lambda)
+{
+    typename V::reg XMMw1 = V::load(w1);
+    typename V::reg XMMw2 = V::load(w2);
+
+    typename V::reg XMMwg1 = V::load(wg1);
+    typename V::reg XMMwg2 = V::load(wg2);
+
+    typename V::reg XMMg1 = V::fmadd(lambda, XMMw1, V::mul(kappav, XMMw2));
+    typename V::reg XMMg2 = V::fmadd(lambda, XMMw2, V::mul(kappav, XMMw1));
+
+    XMMwg1 = V::fmadd(XMMg1, XMMg1, XMMwg1);
+    XMMwg2 = V::fmadd(XMMg2, XMMg2, XMMwg2);
+
+    XMMw1 = V::sub(XMMw1, V::mul(eta, V::mul(V::rsqrt(XMMwg1), XMMg1)));
+    XMMw2 = V::sub(XMMw2, V::mul(eta, V::mul(V::rsqrt(XMMwg2), XMMg2)));
+
+    V::store(w1, XMMw1);
+    V::store(w2, XMMw2);
+
+    V::store(wg1, XMMwg1);
+    V::store(wg2, XMMwg2);
+}
+
+// K is the padded latent dimension when known at compile time, or 0 to 
+// read it from the model. With K fixed the d loops below have constant 
+// trip counts and compile down to straight-line code. 
+//
+// Each feature's row holds its m weight blocks of k floats back to back, 
+// followed during training by the m AdaGrad accumulator blocks, so S is 
+// the row length in units of m*k: 2 while training, 1 once the 
+// accumulators have been dropped. Passes that only score rows never pull
+// accumulators into cache either way.
+template<typename V, ffm_int K, ffm_int S>
+ffm_float wTx_kernel(
+    ffm_node *begin,
+    ffm_node *end,
+    ffm_float r,
+    ffm_model &model,
+    ffm_float kappa,
+    ffm_float eta,
+    ffm_float lambda,
+    bool do_update)
+{
+    ffm_int const k = K != 0 ? K : model.k;
+    ffm_int const k_wide = k - k%V::width;
+
+    ffm_long align0 = (ffm_long)k;
+    ffm_long align1 = (ffm_long)model.m*align0*S;
+
+    typename V::reg YMMeta = V::set1(eta);
+    typename V::reg YMMlambda = V::set1(lambda);
+    __m128 XMMeta = _mm_set1_ps(eta);
+    __m128 XMMlambda = _mm_set1_ps(lambda);
+
+    typename V::reg YMMt = V::zero();
+    __m128 XMMt = _mm_setzero_ps();
+
+    // All the per-node work is done once up front, so the quadratic loop
+    // below is a sweep over pairs of precomputed pointers: pairing each 
+    // node only with the nodes after its own field's run skips same-field
+    // pairs without testing for them.
+    static thread_local std::vector<row_node> nodes;
+    ffm_int nr_nodes = prepare_row(begin, end, model, align0, align1, nodes);
+
+    for(ffm_int n1 = 0; n1 < nr_nodes; n1++)
+    {
+        row_node const &N1 = nodes[n1];
+        ffm_float v1 = N1.v;
+
+        for(ffm_int n2 = N1.field_end; n2 < nr_nodes; n2++)
+        {
+            row_node const &N2 = nodes[n2];
+            ffm_float v2 = N2.v;
+
+            ffm_float *w1 = N1.row + N2.offset;
+            ffm_float *w2 = N2.row + N1.offset;
+
+            ffm_float v = 2.0f*v1*v2*r;
+
+            if(S == 2 && do_update)
+            {
+                ffm_float *wg1 = w1 + model.m*align0;
+                ffm_float *wg2 = w2 + model.m*align0;
+
+                typename V::reg YMMkappav = V::set1(kappa*v);
+                __m128 XMMkappav = _mm_set1_ps(kappa*v);
+
+                ffm_int d = 0;
+                for(; d < k_wide; d += V::width)
+                    update_step<V>(w1+d, w2+d, wg1+d, wg2+d,
+                                   YMMkappav, YMMeta, YMMlambda);
+                for(; d < k; d += sse::width)
+                    update_step<sse>(w1+d, w2+d, wg1+d, wg2+d,
+                                     XMMkappav, XMMeta, XMMlambda);
+            }
+            else
+            {
+                typename V::reg YMMv = V::set1(v);
+                __m128 XMMv = _mm_set1_ps(v);
+
+                ffm_int d = 0;
+                for(; d < k_wide; d += V::width)
+                    YMMt = V::fmadd(V::mul(V::load(w1+d), V::load(w2+d)),
+                                    YMMv, YMMt);
+                for(; d < k; d += sse::width)
+                    XMMt = _mm_add_ps(XMMt, _mm_mul_ps(
+                           _mm_mul_ps(_mm_load_ps(w1+d), _mm_load_ps(w2+d)),
+                           XMMv));
+            }
+        }
+    }
+
+    if(S == 2 && do_update)
+        return 0;
+
+    return V::hsum(YMMt) + sse::hsum(XMMt);
+}
+
+// Gradients of row in buf, taking a new entry if the batch has not 
+// touched the row before.
+inline ffm_float *grad_entry(ffm_grad_buffer &buf, ffm_float *row, ffm_long size)
+{
+    ffm_long slot = 
+        (ffm_long)(((uintptr_t)row >> 4)*0x9e3779b97f4a7c15ULL >> 32) & buf.mask;
+    for(;; slot = (slot+1) & buf.mask)
+    {
+        ffm_int e = buf.index[slot];
+        if(e < 0)
+            break;
+        if(buf.rows[e] == row)
+            return buf.G + e*size;
+    }
+
+    ffm_int e = buf.nr_used++;
+    buf.index[slot] = e;
+    buf.rows[e] = row;
+    buf.slots[e] = slot;
+    ffm_float *G = buf.G + e*size;
+    for(ffm_long d = 0; d < size; d++)
+        G[d] = 0;
+    return G;
+}
+
+// Mini-batch counterpart of wTx_kernel(..., do_update=true): instead of 
+// stepping each pair's two blocks right away, their loss gradients are 
+// summed into buf, so a block shared by many rows of the batch is written
+// once per batch. The table is consulted once per node, not per pair. 
+// Regularization is added by apply_kernel().
+template<typename V, ffm_int K>
+void grad_kernel(
+    ffm_node *begin,
+    ffm_node *end,
+    ffm_float r,
+    ffm_model &model,
+    ffm_float kappa,
+    ffm_grad_buffer &buf)
+{
+    ffm_int const k = K != 0 ? K : model.k;
+    ffm_int const k_wide = k - k%V::width;
+
+    ffm_long align0 = (ffm_long)k;
+    ffm_long align1 = (ffm_long)model.m*align0*2;
+
+    static thread_local std::vector<row_node> nodes;
+    static thread_local std::vector<grad_row> grads;
+    ffm_int nr_nodes = prepare_row(begin, end, model, align0, align1, nodes);
+
+    grads.resize(nr_nodes);
+    for(ffm_int n = 0; n < nr_nodes; n++)
+        grads[n].G = grad_entry(buf, nodes[n].row, model.m*align0);
+
+    for(ffm_int n1 = 0; n1 < nr_nodes; n1++)
+    {
+        row_node const &N1 = nodes[n1];
+
+        for(ffm_int n2 = N1.field_end; n2 < nr_nodes; n2++)
+        {
+            row_node const &N2 = nodes[n2];
+
+            ffm_float *w1 = N1.row + N2.offset;
+            ffm_float *w2 = N2.row + N1.offset;
+
+            ffm_float *G1 = grads[n1].G + N2.offset;
+            ffm_float *G2 = grads[n2].G + N1.offset;
+
+            ffm_float kappav = kappa*2.0f*N1.v*N2.v*r;
+            typename V::reg YMMkappav = V::set1(kappav);
+            __m128 XMMkappav = _mm_set1_ps(kappav);
+
+            ffm_int d = 0;
+            for(; d < k_wide; d += V::width)
+            {
+                typename V::reg YMMw1 = V::load(w1+d);
+                typename V::reg YMMw2 = V::load(w2+d);
+                V::store(G1+d, V::fmadd(YMMkappav, YMMw2, V::load(G1+d)));
+                V::store(G2+d, V::fmadd(YMMkappav, YMMw1, V::load(G2+d)));
+            }
+            for(; d < k; d += sse::width)
+            {
+                __m128 XMMw1 = _mm_load_ps(w1+d);
+                __m128 XMMw2 = _mm_load_ps(w2+d);
+                _mm_store_ps(G1+d, sse::fmadd(XMMkappav, XMMw2, 
+                                              _mm_load_ps(G1+d)));
+                _mm_store_ps(G2+d, sse::fmadd(XMMkappav, XMMw1, 
+                                              _mm_load_ps(G2+d)));
+            }
+        }
+    }
+}
+
+// Applies and clears the gradients summed in buf. Blocks of a touched row
+// that no pair reached have an all-zero gradient and are left alone, as 
+// they would be by plain SGD.
+template<typename V>
+void apply_kernel(
+    ffm_grad_buffer &buf,
+    ffm_model &model,
+    ffm_float eta,
+    ffm_float lambda)
+{
+    ffm_int const k = model.k;
+    ffm_int const k_wide = k - k%V::width;
+    ffm_long const size = (ffm_long)model.m*k;
+
+    typename V::reg YMMeta = V::set1(eta);
+    typename V::reg YMMlambda = V::set1(lambda);
+    __m128 XMMeta = _mm_set1_ps(eta);
+    __m128 XMMlambda = _mm_set1_ps(lambda);
+
+    for(ffm_int e = 0; e < buf.nr_used; e++)
+    {
+        for(ffm_int f = 0; f < model.m; f++)
+        {
+            ffm_float *w = buf.rows[e] + f*k;
+            ffm_float *wg = w + size;
+            ffm_float *G = buf.G + e*size + f*k;
+
+            bool touched = false;
+            for(ffm_int d = 0; d < k; d++)
+                touched |= G[d] != 0;
+            if(!touched)
+                continue;
+
+            ffm_int d = 0;
+            for(; d < k_wide; d += V::width)
+            {
+                typename V::reg YMMw = V::load(w+d);
+                typename V::reg YMMg = V::fmadd(YMMlambda, YMMw, V::load(G+d));
+                typename V::reg YMMwg = V::fmadd(YMMg, YMMg, V::load(wg+d));
+                V::store(wg+d, YMMwg);
+                V::store(w+d, V::sub(YMMw, 
+                    V::mul(YMMeta, V::mul(V::rsqrt(YMMwg), YMMg))));
+            }
+            for(; d < k; d += sse::width)
+            {
+                __m128 XMMw = _mm_load_ps(w+d);
+                __m128 XMMg = sse::fmadd(XMMlambda, XMMw, _mm_load_ps(G+d));
+                __m128 XMMwg = sse::fmadd(XMMg, XMMg, _mm_load_ps(wg+d));
+                _mm_store_ps(wg+d, XMMwg);
+                _mm_store_ps(w+d, _mm_sub_ps(XMMw, 
+                    _mm_mul_ps(XMMeta, _mm_mul_ps(_mm_rsqrt_ps(XMMwg), XMMg))));
+            }
+        }
+
+        buf.index[buf.slots[e]] = -1;
+    }
+
+    buf.nr_used = 0;
+}
+
+template<typename V>
+ffm_kernel make_kernel(char const *name)
+{
+    ffm_kernel kernel;
+    kernel.name = name;
+    kernel.wTx_k4 = wTx_kernel<V, 4, 2>;
+    kernel.wTx_k8 = wTx_kernel<V, 8, 2>;
+    kernel.wTx_k16 = wTx_kernel<V, 16, 2>;
+    kernel.wTx = wTx_kernel<V, 0, 2>;
+    kernel.predict_k4 = wTx_kernel<V, 4, 1>;
+    kernel.predict_k8 = wTx_kernel<V, 8, 1>;
+    kernel.predict_k16 = wTx_kernel<V, 16, 1>;
+    kernel.predict = wTx_kernel<V, 0, 1>;
+    kernel.grad_k4 = grad_kernel<V, 4>;
+    kernel.grad_k8 = grad_kernel<V, 8>;
+    kernel.grad_k16 = grad_kernel<V, 16>;
+    kernel.grad = grad_kernel<V, 0>;
+    kernel.apply = apply_kernel<V>;
+    return kernel;
+}
+
+} // unnamed namespace
+
+} // namespace ffm
+
+#endif // _LIBFFM_KERNEL_H
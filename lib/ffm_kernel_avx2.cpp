@@ -0,0 +1,41 @@
+// Built with -mavx2 -mfma; only called after CPUID reports both.
+
+#include <immintrin.h>
+
+#include "ffm_kernel.h"
+
+namespace ffm {
+
+namespace {
+
+struct avx2
+{
+    typedef __m256 reg;
+    static ffm_int const width = 8;
+
+    static reg zero() { return _mm256_setzero_ps(); }
+    static reg set1(ffm_float x) { return _mm256_set1_ps(x); }
+    static reg load(ffm_float const *p) { return _mm256_loadu_ps(p); }
+    static void store(ffm_float *p, reg x) { _mm256_storeu_ps(p, x); }
+    static reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+    static reg sub(reg a, reg b) { return _mm256_sub_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_ps(a, b); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm256_fmadd_ps(a, b, c); }
+    static reg rsqrt(reg a) { return _mm256_rsqrt_ps(a); }
+
+    static ffm_float hsum(reg x)
+    {
+        return sse::hsum(_mm_add_ps(_mm256_castps256_ps128(x), 
+                                    _mm256_extractf128_ps(x, 1)));
+    }
+};
+
+} // unnamed namespace
+
+ffm_kernel const *ffm_kernel_avx2()
+{
+    static ffm_kernel const kernel = make_kernel<avx2>("avx2");
+    return &kernel;
+}
+
+} // namespace ffm
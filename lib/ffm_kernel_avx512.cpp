@@ -0,0 +1,37 @@
+// Built with -mavx512f -mavx2 -mfma; only called after CPUID reports 
+// AVX-512F.
+
+#include <immintrin.h>
+
+#include "ffm_kernel.h"
+
+namespace ffm {
+
+namespace {
+
+struct avx512
+{
+    typedef __m512 reg;
+    static ffm_int const width = 16;
+
+    static reg zero() { return _mm512_setzero_ps(); }
+    static reg set1(ffm_float x) { return _mm512_set1_ps(x); }
+    static reg load(ffm_float const *p) { return _mm512_loadu_ps(p); }
+    static void store(ffm_float *p, reg x) { _mm512_storeu_ps(p, x); }
+    static reg add(reg a, reg b) { return _mm512_add_ps(a, b); }
+    static reg sub(reg a, reg b) { return _mm512_sub_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm512_mul_ps(a, b); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_ps(a, b, c); }
+    static reg rsqrt(reg a) { return _mm512_rsqrt14_ps(a); }
+    static ffm_float hsum(reg x) { return _mm512_reduce_add_ps(x); }
+};
+
+} // unnamed namespace
+
+ffm_kernel const *ffm_kernel_avx512()
+{
+    static ffm_kernel const kernel = make_kernel<avx512>("avx512");
+    return &kernel;
+}
+
+} // namespace ffm
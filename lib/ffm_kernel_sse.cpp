@@ -0,0 +1,11 @@
+#include "ffm_kernel.h"
+
+namespace ffm {
+
+ffm_kernel const *ffm_kernel_sse()
+{
+    static ffm_kernel const kernel = make_kernel<sse>("sse");
+    return &kernel;
+}
+
+} // namespace ffm
@@ -6,6 +6,11 @@
  * of the BSD license. See the LICENSE file for details.
  */
 
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <graphlab/flexible_type/flexible_type.hpp>
@@ -28,85 +33,277 @@ ffm_problem read_sframe(gl_sframe data, std::string target,
     prob.l = data.size();
     prob.n = max_key_idx;
     prob.m = max_field_idx;
+    prob.X = nullptr;
+    prob.P = nullptr;
+    prob.Y = nullptr;
+    prob.R = nullptr;
+    prob.X_mmapped = false;
     prob.sf = data;
     prob.target_column = target;
     prob.feature_columns = features;
     return prob;
 }
 
-gl_sarray predict_sframe(ffm_model *model, gl_sframe data, std::string target_column, std::vector<std::string> feature_columns) 
+gl_sarray predict_sframe(ffm_model *model, gl_sframe data, std::string target_column, std::vector<std::string> feature_columns, size_t nr_threads) 
 {
-  ffm_double loss = 0;
-  vector<ffm_node> x;
-  ffm_int i = 0;
+  const size_t kBatchSize = 100000;
+  const size_t kMinRangeSize = 10000;
+  // The fast logistic can round to exactly 0 or 1, so predictions are kept
+  // this far inside (0, 1) when the loss takes their log.
+  const ffm_double kEps = 1e-15;
+
+  // The rows are split into one contiguous range per thread. Each range is
+  // decoded and scored on its own and written to its own segment of the 
+  // output, and the segments are concatenated in order when it is closed.
+  size_t nr_rows = data.size();
+  size_t nr_ranges = std::max<size_t>(1, 
+    std::min(std::max<size_t>(nr_threads, 1), nr_rows / kMinRangeSize));
+
+  gl_sarray_writer f_out(flex_type_enum::FLOAT, nr_ranges);
+  std::vector<ffm_double> losses(nr_ranges, 0);
+
+  // A decoding error cannot leave the parallel region, so it is carried 
+  // out of it and rethrown.
+  std::exception_ptr error;
+
+#pragma omp parallel for schedule(static, 1) num_threads(nr_ranges)
+  for (size_t s = 0; s < nr_ranges; ++s) {
+    // Rows are decoded into a CSR batch and scored together by 
+    // ffm_predict_batch().
+    std::vector<ffm_node> x;
+    std::vector<ffm_long> p;
+    std::vector<ffm_float> y, y_bar(kBatchSize);
+
+    size_t range_end = nr_rows * (s+1) / nr_ranges;
+    try {
+      for (size_t begin = nr_rows * s / nr_ranges; begin < range_end; 
+           begin += kBatchSize) {
+        size_t end = std::min(begin + kBatchSize, range_end);
+        ffm_decode_sframe(data, target_column, feature_columns, begin, end, 
+                          x, p, y);
+
+        ffm_predict_batch(x.data(), p.data(), y.size(), model, y_bar.data(), 
+                          1);
+        for (size_t i = 0; i < y.size(); ++i) {
+          f_out.write(y_bar[i], s);
+          ffm_double p_i = std::min(std::max((ffm_double)y_bar[i], kEps), 
+                                    1-kEps);
+          losses[s] -= y[i]==1? log(p_i) : log(1-p_i);
+        }
+      }
+    } catch (...) {
+#pragma omp critical
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  }
 
-  size_t target_col_idx = get_column_index(data, target_column); 
-  std::vector<size_t> feature_col_idxs;
-  for (auto col : feature_columns) { 
-    feature_col_idxs.push_back(get_column_index(data, col));
+  if (error) {
+    std::rethrow_exception(error);
   }
 
-  gl_sarray_writer f_out(flex_type_enum::FLOAT, 1);
-  size_t index = 0;
-  auto r = data.range_iterator();
-  auto it = r.begin();
-  for (; it != r.end(); ++it, ++index) { 
+  // An empty SFrame has no loss to report.
+  if (nr_rows > 0) {
+    ffm_double loss = 0;
+    for (ffm_double l : losses) {
+      loss += l;
+    }
+    loss /= nr_rows;
 
-    x.clear();
+    logprogress_stream << "logloss = " << fixed << setprecision(5) << loss 
+                       << endl;
+  }
 
-    const std::vector<flexible_type>& row = *it;
-    const auto& yval = row[target_col_idx];
-    ffm_float y = (yval.get<flex_int>() > 0) ? 1.0f : -1.0f;
+  return f_out.close();
+}
 
-    for (const size_t col_idx : feature_col_idxs) { 
-      if (row[col_idx] != FLEX_UNDEFINED) {
-        const flex_dict& dv = row[col_idx].get<flex_dict>(); 
-        size_t n_values = dv.size(); 
+// Reads a libffm text file with the library's parallel parser into an 
+// SFrame laid out like convert.py's: an integer column "y" and one dict 
+// column "features.<field>" per field that occurs. Each thread builds the
+// rows of its own range and writes them to its own output segment.
+gl_sframe read_libffm(std::string path, size_t nr_threads)
+{
+  nr_threads = std::max<size_t>(nr_threads, 1);
 
-        for(size_t k = 0; k < n_values; ++k) { 
-          const std::pair<flexible_type, flexible_type>& kvp = dv[k];
+  ffm_problem prob;
+  if (ffm_read_problem(path.c_str(), nr_threads, &prob) != 0) {
+    log_and_throw("Unable to read " + path);
+  }
 
+  std::vector<char> used(prob.m, 0);
+  for (ffm_long p = 0; p < prob.P[prob.l]; ++p) {
+    used[prob.X[p].f] = 1;
+  }
 
-          ffm_node N;
-          N.f = col_idx; 
-          N.j = kvp.first.get<flex_int>(); 
-          N.v = (float) kvp.second;
+  gl_sarray_writer y_out(flex_type_enum::INTEGER, nr_threads);
+  std::vector<std::unique_ptr<gl_sarray_writer>> f_out(prob.m);
+  for (ffm_int f = 0; f < prob.m; ++f) {
+    if (used[f]) {
+      f_out[f].reset(new gl_sarray_writer(flex_type_enum::DICT, nr_threads));
+    }
+  }
 
-          x.push_back(N);
+#pragma omp parallel for schedule(static, 1) num_threads(nr_threads)
+  for (size_t s = 0; s < nr_threads; ++s) {
+    std::vector<flex_dict> dicts(prob.m);
+    ffm_int begin = (ffm_long)prob.l * s / nr_threads;
+    ffm_int end = (ffm_long)prob.l * (s+1) / nr_threads;
+    for (ffm_int i = begin; i < end; ++i) {
+      for (ffm_long p = prob.P[i]; p < prob.P[i+1]; ++p) {
+        const ffm_node& N = prob.X[p];
+        dicts[N.f].push_back({flexible_type((flex_int)N.j), 
+                              flexible_type((flex_float)N.v)});
+      }
+      y_out.write(prob.Y[i] > 0 ? 1 : 0, s);
+      for (ffm_int f = 0; f < prob.m; ++f) {
+        if (!used[f]) {
+          continue;
+        }
+        if (dicts[f].empty()) {
+          f_out[f]->write(FLEX_UNDEFINED, s);
+        } else {
+          f_out[f]->write(dicts[f], s);
+          dicts[f].clear();
         }
       }
     }
-
-    ffm_float y_bar = ffm_predict(x.data(), x.data()+x.size(), model);
-    f_out.write(y_bar, 0);
-
-    loss -= y==1? log(y_bar) : log(1-y_bar);
   }
 
-  loss /= i;
+  ffm_destroy_problem(&prob);
 
-  logprogress_stream << "logloss = " << fixed << setprecision(5) << loss << endl;
+  std::map<std::string, gl_sarray> columns;
+  columns["y"] = y_out.close();
+  for (ffm_int f = 0; f < (ffm_int)f_out.size(); ++f) {
+    if (f_out[f]) {
+      columns["features." + std::to_string(f)] = f_out[f]->close();
+    }
+  }
+  return gl_sframe(columns);
+}
 
-  return f_out.close();
+// Reads a CSR block from the raw array files at prefix, see 
+// ffm_read_array_files().
+ffm_problem read_array_files(std::string const &prefix, bool labeled, 
+                             size_t nr_threads)
+{
+  ffm_problem prob;
+  if (ffm_read_array_files(prefix.c_str(), labeled, nr_threads, &prob) != 0) {
+    log_and_throw("Unable to read arrays from " + prefix + ".*: they must "
+                  "agree in size, have ascending indptr and non-negative "
+                  "fields and indices");
+  }
+  return prob;
 }
 
 class ffm_py : public toolkit_class_base {
 
   ffm_parameter param;
-  ffm_model* model;
-  ffm_problem train;
-  ffm_problem valid;
+  ffm_model* model = nullptr;
+  ffm_problem train = ffm_problem();
+  ffm_problem valid = ffm_problem();
   std::string target;
   std::vector<std::string> features;
 
-  virtual void save_impl(oarchive& oarc) const  {}
+  virtual size_t get_version() const { return 1; }
+
+  // Version 1: the parameters, target and features, then whether there is
+  // a model and, if so, the model in the binary file format, so its 
+  // weights go through the archive as one block instead of being parsed.
+  virtual void save_impl(oarchive& oarc) const {
+    oarc << param.eta << param.lambda << param.nr_iters << param.k 
+         << param.nr_threads << param.quiet << param.normalization 
+         << param.random << param.sparse << param.loss_interval 
+         << param.auto_stop << param.patience << param.batch_size;
+    oarc << target << features;
+    oarc << (model != nullptr);
+    if (model != nullptr) {
+      ffm_write_model(model, [&oarc](void const* data, size_t size) {
+        serialize(oarc, data, size);
+        return true;
+      });
+    }
+  }
 
-  virtual void load_version(iarchive& iarc, size_t version) {}
+  virtual void load_version(iarchive& iarc, size_t version) {
+    if (version > 1) {
+      log_and_throw("Unknown ffm_py version " + std::to_string(version));
+    }
+    param = ffm_get_default_param();
+    ffm_destroy_model(&model);
+    // Version 0 saved nothing, so such objects come back untrained.
+    if (version == 0) {
+      target.clear();
+      features.clear();
+      return;
+    }
+    iarc >> param.eta >> param.lambda >> param.nr_iters >> param.k 
+         >> param.nr_threads >> param.quiet >> param.normalization 
+         >> param.random >> param.sparse >> param.loss_interval 
+         >> param.auto_stop >> param.patience >> param.batch_size;
+    iarc >> target >> features;
+    bool has_model = false;
+    iarc >> has_model;
+    if (has_model) {
+      model = ffm_read_model([&iarc](void* data, size_t size) {
+        deserialize(iarc, data, size);
+        return true;
+      });
+      if (model == nullptr) {
+        log_and_throw("Unable to read the model");
+      }
+    }
+  }
+
+  public:
+  ~ffm_py() {
+    ffm_destroy_model(&model); 
+    ffm_destroy_problem(&train);
+    ffm_destroy_problem(&valid);
+  }
+
+  // Trains on the train and valid members, which have been decoded, and
+  // destroys them afterwards.
+  void train_model(std::string const &checkpoint_path,
+                   size_t checkpoint_interval,
+                   std::string const &resume_path,
+                   size_t warm_start) {
+    // An empty path turns checkpointing or resuming off. The strings 
+    // outlive training, so param can point into them.
+    param.checkpoint_path = 
+      checkpoint_path.empty() ? nullptr : checkpoint_path.c_str();
+    param.checkpoint_interval = checkpoint_interval;
+    param.resume_path = resume_path.empty() ? nullptr : resume_path.c_str();
+
+    // A warm start continues from the current model, or from the 
+    // checkpoint at resume_path together with its optimizer state.
+    ffm_model* init = warm_start && resume_path.empty() ? model : nullptr;
+    if (warm_start && init == nullptr && resume_path.empty()) {
+      ffm_destroy_problem(&train);
+      ffm_destroy_problem(&valid);
+      log_and_throw("warm_start needs a trained or loaded model");
+    }
 
-  // public:
-  // ~ffm_py() {
-  //   ffm_destroy_model(&model); 
-  // }
+    // Arrays come without a validation set unless one was given.
+    ffm_problem* va = valid.X != nullptr ? &valid : nullptr;
+    ffm_model* trained = warm_start ? 
+      ffm_train_incremental(init, &train, va, param) :
+      train_with_validation(&train, va, param);
+
+    param.checkpoint_path = nullptr;
+    param.resume_path = nullptr;
+
+    ffm_destroy_problem(&train);
+    ffm_destroy_problem(&valid);
+
+    if (trained == nullptr) {
+      log_and_throw(resume_path.empty() ? 
+                    std::string("The model does not match the parameters") :
+                    "Unable to resume training from " + resume_path);
+    }
+    ffm_destroy_model(&model);
+    model = trained;
+  }
 
   std::map<flexible_type, flexible_type> get_params() {
     auto p = std::map<flexible_type, flexible_type>();
@@ -118,6 +315,10 @@ class ffm_py : public toolkit_class_base {
     p["quiet"] = param.quiet;
     p["normalization"] = param.normalization;
     p["random"] = param.random;
+    p["sparse"] = param.sparse;
+    p["auto_stop"] = param.auto_stop;
+    p["patience"] = param.patience;
+    p["batch_size"] = param.batch_size;
     return p;
   }
 
@@ -128,22 +329,39 @@ class ffm_py : public toolkit_class_base {
     param.k = k;
   }
 
-  void set_param(size_t nr_iters, size_t nr_threads, size_t quiet) {
+  void set_param(size_t nr_iters, size_t nr_threads, size_t quiet, 
+                 size_t random, size_t sparse, size_t auto_stop, 
+                 size_t patience, size_t batch_size) {
     param.nr_iters = nr_iters;
     param.nr_threads = nr_threads;
     param.quiet = quiet;
+    param.random = random;
+    param.sparse = sparse;
+    param.auto_stop = auto_stop;
+    param.patience = patience;
+    param.batch_size = batch_size;
   }
   
   void load_model(std::string filename) {
     const char * c = filename.c_str();
     ffm_model* m = ffm_load_model(c);
+    if (m == nullptr) {
+      log_and_throw("Unable to load model from " + filename);
+    }
+    ffm_destroy_model(&model);
+    model = m;
   }
 
   void fit(gl_sframe trainsf, 
            gl_sframe validsf, 
            std::string _target, 
            std::vector<std::string> _features, 
-           size_t max_feature_id) {
+           size_t max_feature_id,
+           std::string cache_path,
+           std::string checkpoint_path,
+           size_t checkpoint_interval,
+           std::string resume_path,
+           size_t warm_start) {
     target = _target;
     features = _features;
 
@@ -155,11 +373,76 @@ class ffm_py : public toolkit_class_base {
 
     train = read_sframe(trainsf, target, features, F, max_feature_id);
     valid = read_sframe(validsf, target, features, F, max_feature_id);
-    model = train_with_validation(&train, &valid, param);
+
+    // Decode both SFrames once up front; every epoch and validation pass
+    // then reads the cached nodes. An empty cache_path keeps them in memory.
+    std::string tr_cache = cache_path.empty() ? "" : cache_path + ".tr";
+    std::string va_cache = cache_path.empty() ? "" : cache_path + ".va";
+    if (ffm_materialize_problem(&train, 
+          tr_cache.empty() ? nullptr : tr_cache.c_str()) != 0 ||
+        ffm_materialize_problem(&valid, 
+          va_cache.empty() ? nullptr : va_cache.c_str()) != 0) {
+      ffm_destroy_problem(&train);
+      log_and_throw("Unable to write node cache to " + cache_path);
+    }
+
+    train_model(checkpoint_path, checkpoint_interval, resume_path, 
+                warm_start);
+  }
+
+  // CSR input, e.g. from NumPy arrays, passed as raw array files that 
+  // ffm_read_array_files() maps: <prefix>.field, .index, .value, .indptr
+  // and .label. Toolkits run in GraphLab's server process, which cannot 
+  // read the client's memory but shares its filesystem, so the client 
+  // writes the arrays out once and they are read in place from there. 
+  // set_arrays reads them into the training ("train") or validation 
+  // ("valid") set. The field of a node is taken as is, unlike with 
+  // SFrames, where it is the column.
+  void set_arrays(std::string which, std::string prefix) {
+    if (which != "train" && which != "valid") {
+      log_and_throw("Unknown set " + which);
+    }
+    ffm_problem &prob = which == "train" ? train : valid;
+    ffm_destroy_problem(&prob);
+    prob = read_array_files(prefix, true, param.nr_threads);
+  }
+
+  void fit_arrays(std::string checkpoint_path,
+                  size_t checkpoint_interval,
+                  std::string resume_path,
+                  size_t warm_start) {
+    if (train.X == nullptr) {
+      log_and_throw("set_arrays has not been given a training set");
+    }
+    train_model(checkpoint_path, checkpoint_interval, resume_path, 
+                warm_start);
+  }
+
+  // Scores CSR rows laid out as for set_arrays, without .label, and 
+  // writes one float32 prediction per row to out_path.
+  void predict_arrays(std::string prefix, std::string out_path) {
+    if (model == nullptr) {
+      log_and_throw("The model has not been trained or loaded");
+    }
+    ffm_problem prob = read_array_files(prefix, false, param.nr_threads);
+    std::vector<ffm_float> out(prob.l);
+    ffm_predict_batch(prob.X, prob.P, prob.l, model, out.data(), 
+                      param.nr_threads);
+    ffm_destroy_problem(&prob);
+
+    std::ofstream f_out(out_path, std::ios::binary);
+    f_out.write((const char*)out.data(), out.size()*sizeof(ffm_float));
+    if (!f_out) {
+      log_and_throw("Unable to write predictions to " + out_path);
+    }
+  }
+
+  gl_sframe read_text(std::string path, size_t nr_threads) {
+    return read_libffm(path, nr_threads);
   }
 
   gl_sarray predict(gl_sframe testsf) {
-    return predict_sframe(model, testsf, target, features);
+    return predict_sframe(model, testsf, target, features, param.nr_threads);
   }
 
   BEGIN_CLASS_MEMBER_REGISTRATION("ffm_py")
@@ -167,13 +450,27 @@ class ffm_py : public toolkit_class_base {
   REGISTER_CLASS_MEMBER_FUNCTION(ffm_py::init_model, 
                                  "eta", "lambda", "k");
   REGISTER_CLASS_MEMBER_FUNCTION(ffm_py::set_param, 
-                                 "nr_iters", "nr_threads", "quiet");
+                                 "nr_iters", "nr_threads", "quiet", "random",
+                                 "sparse", "auto_stop", "patience",
+                                 "batch_size");
   REGISTER_CLASS_MEMBER_FUNCTION(ffm_py::fit, 
-                                 "train", "valid", "target", "features", "max_feature_id");
+                                 "train", "valid", "target", "features", "max_feature_id",
+                                 "cache_path", "checkpoint_path",
+                                 "checkpoint_interval", "resume_path",
+                                 "warm_start");
   REGISTER_CLASS_MEMBER_FUNCTION(ffm_py::predict, 
                                  "test");
+  REGISTER_CLASS_MEMBER_FUNCTION(ffm_py::set_arrays, 
+                                 "which", "prefix");
+  REGISTER_CLASS_MEMBER_FUNCTION(ffm_py::fit_arrays, 
+                                 "checkpoint_path", "checkpoint_interval",
+                                 "resume_path", "warm_start");
+  REGISTER_CLASS_MEMBER_FUNCTION(ffm_py::predict_arrays, 
+                                 "prefix", "out_path");
   REGISTER_CLASS_MEMBER_FUNCTION(ffm_py::load_model, 
                                  "filename");
+  REGISTER_CLASS_MEMBER_FUNCTION(ffm_py::read_text, 
+                                 "path", "nr_threads");
   END_CLASS_MEMBER_REGISTRATION
 };
 